@@ -0,0 +1,33 @@
+#!/bin/bash
+# usage: bench/bench.sh [runs]
+# Runs each benchmark with ./minivm $FLAGS and prints the median wall time, the
+# instructions executed and the peak RSS. The results are also written as tab
+# separated values to $OUT (bench.tsv by default); pass a previous file as
+# $BASE to print the speedup against it.
+dir=$(dirname $0)
+bin=$dir/../minivm
+runs=${1:-5}
+out=${OUT:-bench.tsv}
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+cc -O2 -o $tmp/measure $dir/measure.c || exit 1
+# variables.in stresses the compiler with 10000 distinct globals.
+{
+  for ((i = 0; i < 10000; ++i)); do echo "v$i = $i"; done
+  echo "s = 0"
+  for ((i = 0; i < 10000; ++i)); do echo "s = s + v$i"; done
+  echo "print s"
+} > $tmp/variables.in
+printf "name\tseconds\tinstructions\tmaxrss_kb\n" > $out
+printf "%-20s %9s %15s %10s%s\n" name seconds instructions maxrss_kb "${BASE:+ speedup}"
+for f in $dir/*.in $tmp/variables.in; do
+  name=$(basename $f .in)
+  result=$($tmp/measure $runs $f $bin $FLAGS) || { echo "$result"; exit 1; }
+  read -r t n rss <<< "$result"
+  printf "%s\t%s\t%s\t%s\n" $name $t $n $rss >> $out
+  speedup=
+  if [[ -n $BASE ]]; then
+    speedup=$(awk -v n=$name -v t=$t '$1 == n && t > 0 { printf " %.2fx", $2 / t }' $BASE)
+  fi
+  printf "%-20s %9s %15s %10s%s\n" $name $t $n $rss "$speedup"
+done
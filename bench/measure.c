@@ -0,0 +1,105 @@
+// Runs a command several times with its stdin from a file and its stdout
+// discarded, then prints the median wall time in seconds, the median number
+// of user space instructions (- when they cannot be counted) and the peak
+// resident set size in KiB.
+//   usage: measure RUNS INPUT COMMAND [ARG]...
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+static int open_counter(pid_t pid) {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static int compare(const void* a, const void* b) {
+  int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char* argv[]) {
+  int i, runs, sync[2], status, counter;
+  int64_t *times, *instructions, count;
+  long rss = 0;
+  struct timespec start, end;
+  struct rusage ru;
+  if (argc < 4 || (runs = atoi(argv[1])) <= 0) {
+    printf("usage: measure RUNS INPUT COMMAND [ARG]...\n");
+    exit(1);
+  }
+  times = calloc(runs, sizeof(int64_t));
+  instructions = calloc(runs, sizeof(int64_t));
+  for (i = 0; i < runs; ++i) {
+    if (pipe(sync) < 0) {
+      printf("pipe failed\n");
+      exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+      // Wait until the counter is attached, which then starts at exec.
+      char c;
+      close(sync[1]);
+      if (read(sync[0], &c, 1) < 0)
+        _exit(127);
+      int in = open(argv[2], O_RDONLY), out = open("/dev/null", O_WRONLY);
+      if (in < 0 || out < 0)
+        _exit(127);
+      dup2(in, 0);
+      dup2(out, 1);
+      execvp(argv[3], argv + 3);
+      _exit(127);
+    }
+    close(sync[0]);
+    counter = open_counter(pid);
+    close(sync[1]);
+    if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+      printf("%s failed\n", argv[3]);
+      exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    times[i] = (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+    instructions[i] = -1;
+    if (counter >= 0) {
+      if (read(counter, &count, sizeof(count)) == sizeof(count))
+        instructions[i] = count;
+      close(counter);
+    }
+    if (ru.ru_maxrss > rss)
+      rss = ru.ru_maxrss;
+  }
+  qsort(times, runs, sizeof(int64_t), compare);
+  qsort(instructions, runs, sizeof(int64_t), compare);
+  printf("%.3f ", times[runs / 2] / 1e9);
+  if (instructions[runs / 2] < 0)
+    printf("- ");
+  else
+    printf("%lld ", (long long)instructions[runs / 2]);
+  printf("%ld\n", rss);
+  free(times);
+  free(instructions);
+  return 0;
+}
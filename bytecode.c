@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vm.h"
+
+// Bump the version whenever the opcodes or the instruction encoding change.
+#define MVC_MAGIC "MVC\n"
+#define MVC_VERSION 2
+
+// The file is this header followed by the instructions and the constants.
+// The header is a multiple of 8 bytes so that the mapped arrays stay aligned.
+typedef struct mvc_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t source_hash;
+  uint32_t codes;
+  uint32_t constants;
+  uint32_t variables;
+  uint32_t reserved;
+} mvc_header;
+
+static uint64_t hash_source(const char* source, size_t length) {
+  uint64_t h = 0xcbf29ce484222325;
+  for (size_t i = 0; i < length; ++i)
+    h = (h ^ (uint8_t)source[i]) * 0x100000001b3;
+  return h;
+}
+
+static char* read_source(FILE* fp, size_t* length) {
+  size_t cap = 4096, n;
+  char* source = malloc(cap);
+  *length = 0;
+  while ((n = fread(source + *length, 1, cap - *length, fp)) > 0) {
+    *length += n;
+    if (*length == cap)
+      source = realloc(source, cap *= 2);
+  }
+  return source;
+}
+
+static bool is_bytecode_file(const char* path) {
+  size_t n = strlen(path);
+  return n >= 4 && !strcmp(path + n - 4, ".mvc");
+}
+
+// Whether path already holds the bytecode of the source with this hash, as
+// written by this version of minivm.
+static bool is_bytecode_current(const char* path, uint64_t source_hash) {
+  mvc_header h;
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  bool current;
+  if (fd < 0)
+    return false;
+  current = fstat(fd, &st) == 0 && read(fd, &h, sizeof(h)) == sizeof(h) &&
+    !memcmp(h.magic, MVC_MAGIC, 4) && h.version == MVC_VERSION && h.source_hash == source_hash &&
+    st.st_size == sizeof(mvc_header) + h.codes * sizeof(uint64_t) + h.constants * sizeof(constant_value);
+  close(fd);
+  return current;
+}
+
+static void write_bytecode(env* e, const char* path, uint64_t source_hash) {
+  mvc_header h = {
+    .magic = MVC_MAGIC,
+    .version = MVC_VERSION,
+    .source_hash = source_hash,
+    .codes = e->codesidx,
+    .constants = e->constantsidx,
+    .variables = e->variableslen,
+  };
+  FILE* fp = fopen(path, "wb");
+  if (fp == NULL) {
+    printf("Cannot open %s\n", path);
+    exit(1);
+  }
+  if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+      fwrite(e->codes, sizeof(uint64_t), e->codesidx, fp) != e->codesidx ||
+      fwrite(e->constants, sizeof(constant_value), e->constantsidx, fp) != e->constantsidx ||
+      fclose(fp)) {
+    printf("Cannot write %s\n", path);
+    exit(1);
+  }
+}
+
+// The instructions and the constants are used in place. The mapping is private
+// and writable, since quickening rewrites opcodes; only the touched pages get copied.
+static void load_bytecode(env* e, const char* path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    printf("Cannot open %s\n", path);
+    exit(1);
+  }
+  if (st.st_size < sizeof(mvc_header)) {
+    printf("Invalid bytecode file: %s\n", path);
+    exit(1);
+  }
+  char* p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    printf("mmap failed\n");
+    exit(1);
+  }
+  mvc_header* h = (mvc_header*)p;
+  if (memcmp(h->magic, MVC_MAGIC, 4) || h->variables > MAX_VARIABLES ||
+      st.st_size != sizeof(mvc_header) + h->codes * sizeof(uint64_t) + h->constants * sizeof(constant_value)) {
+    printf("Invalid bytecode file: %s\n", path);
+    exit(1);
+  }
+  if (h->version != MVC_VERSION) {
+    printf("Bytecode version mismatch: %s (%u, expected %u)\n", path, h->version, MVC_VERSION);
+    exit(1);
+  }
+  free(e->codes);
+  free(e->constants);
+  e->codes = (uint64_t*)(p + sizeof(mvc_header));
+  e->codesidx = e->codeslen = h->codes;
+  e->constants = (constant_value*)(e->codes + h->codes);
+  e->constantsidx = e->constantslen = h->constants;
+  e->mapping = p;
+  e->mapping_size = st.st_size;
+  reserve_variables(e, h->variables + 1);
+  e->variableslen = h->variables;
+}
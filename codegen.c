@@ -1,71 +1,126 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
 #include "node.h"
 #include "opcode.h"
 #include "vm.h"
 #include "func.c"
 
+static void clear_variable_map(variable_map* m) {
+  memset(m->slots, 0xff, m->length * sizeof(int32_t));
+}
+
 static env* new_env() {
+  int i;
   env* e = (env*)malloc(sizeof(env));
   if (!e)
     return NULL;
   e->codesidx = 0;
   e->codeslen = 1024;
-  e->codes = calloc(e->codeslen, sizeof(uint32_t));
+  e->codes = calloc(e->codeslen, sizeof(uint64_t));
   e->constantsidx = 0;
   e->constantslen = 128;
   e->constants = calloc(e->constantslen, sizeof(constant_value));
   e->stackidx = 0;
+  e->stacklen = 0;
   e->stack = NULL;
-  e->variables = calloc(128, sizeof(variable));
+  e->stack_depth = 0;
+  e->frame_depth = 0;
+  e->entries = NULL;
+  e->variablescap = 128;
+  e->variables = calloc(e->variablescap, sizeof(variable));
+  for (i = 0; i < e->variablescap; ++i)
+    e->variables[i].value = BOOL_VAL(false);
   e->variableslen = 0;
+  e->frames = NULL;
+  e->framesidx = 0;
+  e->frameslen = 0;
   e->local_variables = NULL;
   e->local_variables_len = 0;
-  e->func_pc = 0;
+  e->local_variables_cap = 0;
+  e->variable_map.length = e->local_variable_map.length = 256;
+  e->variable_map.slots = malloc(e->variable_map.length * sizeof(int32_t));
+  e->local_variable_map.slots = malloc(e->local_variable_map.length * sizeof(int32_t));
+  clear_variable_map(&e->variable_map);
+  clear_variable_map(&e->local_variable_map);
   e->while_pc = 0;
+  e->for_depth = 0;
+  e->variable_types = malloc(TYPED_VARIABLES);
+  memset(e->variable_types, VT_UNSET, TYPED_VARIABLES);
+  e->local_variable_types = NULL;
+  e->function_types = NULL;
+  e->functionsidx = 0;
+  e->functionslen = 0;
+  e->typed_ops = 0;
+  e->untyped_ops = 0;
+  e->mapping = NULL;
+  e->mapping_size = 0;
   return e;
 }
 
 static void free_env(env* e) {
-  free(e->codes);
-  free(e->constants);
+  int i;
+  if (e->mapping != NULL) {
+    munmap(e->mapping, e->mapping_size);
+  } else {
+    free(e->codes);
+    free(e->constants);
+  }
+  free(e->stack);
+  free(e->entries);
   free(e->variables);
+  free(e->frames);
+  free(e->variable_map.slots);
+  free(e->local_variable_map.slots);
+  free(e->variable_types);
+  for (i = 0; i < e->functionslen; ++i)
+    free(e->function_types[i]);
+  free(e->function_types);
   free(e);
 }
 
-#define GET_OPCODE(i)       ((uint8_t)(i & 0xff))
-#define GET_ARG_A(i)        ((int16_t)((i >> 8) & 0xffff))
-#define GET_ARG_B(i)        ((int8_t)((i >> 24) & 0xff))
+/*
+ * An instruction is a 64-bit word: the opcode in the low 8 bits, a signed
+ * 32-bit argument A (jump offsets, constant indices and variable slots) and a
+ * signed 24-bit argument B.
+ */
+#define GET_OPCODE(i)       ((uint8_t)((i) & 0xff))
+#define GET_ARG_A(i)        ((int32_t)(((i) >> 8) & 0xffffffff))
+#define GET_ARG_B(i)        ((int32_t)((int64_t)(i) >> 40))
+#define SET_OPCODE(i,op)    ((i) = ((i) & ~(uint64_t)0xff) | (op))
 
-#define MK_ARG_A(a)         ((intptr_t)((a) & 0xffff) << 8)
-#define MK_ARG_B(a)         ((intptr_t)((a) & 0xff) << 24)
+#define MK_ARG_A(a)         ((uint64_t)((a) & 0xffffffff) << 8)
+#define MK_ARG_B(a)         ((uint64_t)((a) & 0xffffff) << 40)
 #define MK_OP_A(op,a)       ((op)|MK_ARG_A(a))
 #define MK_OP_AB(op,a,b)    ((op)|MK_ARG_A(a)|MK_ARG_B(b))
 
-static uint16_t addcode(env* e, uint32_t c) {
+static uint32_t addcode(env* e, uint64_t c) {
   if (e->codesidx == e->codeslen) {
-    uint32_t* old_codes = e->codes;
-    e->codes = calloc(e->codeslen * 2, sizeof(uint32_t));
-    memcpy(e->codes, old_codes, e->codeslen * sizeof(uint32_t));
+    if (e->codeslen > UINT32_MAX / 2) {
+      printf("Too many instructions\n");
+      exit(1);
+    }
     e->codeslen *= 2;
-    free(old_codes);
+    e->codes = realloc(e->codes, e->codeslen * sizeof(uint64_t));
   }
   e->codes[e->codesidx] = c;
   return e->codesidx++;
 }
 
-static void operand(env* e, uint16_t index, int32_t a) {
+static void operand(env* e, uint32_t index, int32_t a) {
   e->codes[index] |= MK_ARG_A(a);
 }
 
-static uint16_t addconstant(env* e, constant_value v) {
+static uint32_t addconstant(env* e, constant_value v) {
   if (e->constantsidx == e->constantslen) {
-    constant_value* old_constants = e->constants;
-    e->constants = calloc(e->constantslen * 2, sizeof(constant_value));
-    memcpy(e->constants, old_constants, e->constantslen * sizeof(constant_value));
+    if (e->constantslen > INT32_MAX / 2) {
+      printf("Too many constants\n");
+      exit(1);
+    }
     e->constantslen *= 2;
-    free(old_constants);
+    e->constants = realloc(e->constants, e->constantslen * sizeof(constant_value));
   }
   e->constants[e->constantsidx] = v;
   return e->constantsidx++;
@@ -76,105 +131,291 @@ typedef struct variable_index {
   int index;
 } variable_index;
 
+static int32_t* find_variable(variable_map* m, variable* vars, char* name) {
+  uint64_t h = (uintptr_t)name * 0x9e3779b97f4a7c15ULL;
+  uint32_t i = (h >> 32) & (m->length - 1);
+  while (m->slots[i] >= 0 && vars[m->slots[i]].name != name)
+    i = (i + 1) & (m->length - 1);
+  return &m->slots[i];
+}
+
+static void add_variable(variable_map* m, variable* vars, int index) {
+  int i;
+  if ((index + 1) * 2 > m->length) {
+    m->length *= 2;
+    m->slots = realloc(m->slots, m->length * sizeof(int32_t));
+    clear_variable_map(m);
+    for (i = 0; i < index; ++i)
+      *find_variable(m, vars, vars[i].name) = i;
+  }
+  *find_variable(m, vars, vars[index].name) = index;
+}
+
+// Names are interned by the lexer, so variables are found by pointer.
 static variable_index lookup(env* e, char* name, bool set) {
   variable_index vi;
+  int32_t* slot;
   if (e->local_variables != NULL) {
     vi.global = false;
-    vi.index = 0;
-    while (e->local_variables[vi.index].name) {
-      if (strcmp(e->local_variables[vi.index].name, name) == 0)
-        return vi;
-      vi.index++;
+    slot = find_variable(&e->local_variable_map, e->local_variables, name);
+    if (*slot >= 0) {
+      vi.index = *slot;
+      return vi;
     }
     if (set) {
+      vi.index = e->local_variables_len;
+      if (vi.index == MAX_VARIABLES) {
+        printf("Too many variables\n");
+        exit(1);
+      }
+      if (vi.index == e->local_variables_cap) {
+        e->local_variables_cap *= 2;
+        e->local_variables = realloc(e->local_variables, e->local_variables_cap * sizeof(variable));
+      }
       e->local_variables[vi.index].name = name;
       e->local_variables_len = vi.index + 1;
+      add_variable(&e->local_variable_map, e->local_variables, vi.index);
       return vi;
     }
   }
   vi.global = true;
-  vi.index = 0;
-  while (e->variables[vi.index].name) {
-    if (strcmp(e->variables[vi.index].name, name) == 0)
-      return vi;
-    vi.index++;
+  slot = find_variable(&e->variable_map, e->variables, name);
+  if (*slot >= 0) {
+    vi.index = *slot;
+    return vi;
   }
   if (set) {
+    vi.index = e->variableslen;
+    if (vi.index == MAX_VARIABLES) {
+      printf("Too many variables\n");
+      exit(1);
+    }
+    reserve_variables(e, vi.index + 2);
     e->variables[vi.index].name = name;
     e->variableslen = vi.index + 1;
+    add_variable(&e->variable_map, e->variables, vi.index);
     return vi;
   }
   vi.index = -1;
   return vi;
 }
 
-static uint16_t let_args(env* e, node* fargs) {
-  uint16_t count = 0;
+static void new_local_variables(env* e) {
+  e->local_variables_cap = 128;
+  e->local_variables = calloc(e->local_variables_cap, sizeof(variable));
+  e->local_variables_len = 0;
+  clear_variable_map(&e->local_variable_map);
+}
+
+static int declare_args(env* e, node* params) {
+  int count = 0;
+  for (; params != NULL; params = params->next, ++count)
+    lookup(e, params->name, true);
+  return count;
+}
+
+static uint32_t codegen(env*, node*);
+static int infer_type(env*, node*);
+
+#define TYPED_OPCODE(op) \
+  case OP_##op: return type == VT_LONG ? OP_##op##_LONG : OP_##op##_DOUBLE;
+#define TYPED_LONG_OPCODE(op) \
+  case OP_##op: return type == VT_LONG ? OP_##op##_LONG : OP_##op;
+
+static uint8_t typed_opcode(uint8_t op, int type) {
+  switch (op) {
+    TYPED_OPCODE(JMP_IFNOT_GT)
+    TYPED_OPCODE(JMP_IFNOT_GE)
+    TYPED_OPCODE(JMP_IFNOT_EQEQ)
+    TYPED_OPCODE(JMP_IFNOT_NEQ)
+    TYPED_OPCODE(JMP_IFNOT_LT)
+    TYPED_OPCODE(JMP_IFNOT_LE)
+    TYPED_OPCODE(ADD)
+    TYPED_OPCODE(MINUS)
+    TYPED_OPCODE(TIMES)
+    TYPED_OPCODE(DIVIDE)
+    TYPED_OPCODE(GT)
+    TYPED_OPCODE(GE)
+    TYPED_OPCODE(EQEQ)
+    TYPED_OPCODE(NEQ)
+    TYPED_OPCODE(LT)
+    TYPED_OPCODE(LE)
+    TYPED_LONG_OPCODE(IADD)
+    TYPED_LONG_OPCODE(IMINUS)
+    TYPED_LONG_OPCODE(INC)
+    TYPED_LONG_OPCODE(INC_LOCAL)
+    TYPED_LONG_OPCODE(IGT)
+    TYPED_LONG_OPCODE(IGE)
+    TYPED_LONG_OPCODE(IEQEQ)
+    TYPED_LONG_OPCODE(INEQ)
+    TYPED_LONG_OPCODE(ILT)
+    TYPED_LONG_OPCODE(ILE)
+    default: return op;
+  }
+}
+
+// Picks the unboxed variant of op when both operands have the same proven type.
+static uint8_t specialize(env* e, uint8_t op, node* lhs, node* rhs) {
+  int type = infer_type(e, lhs);
+  if (infer_type(e, rhs) != type || (type != VT_LONG && type != VT_DOUBLE) ||
+      typed_opcode(op, type) == op) {
+    e->untyped_ops++;
+    return op;
+  }
+  e->typed_ops++;
+  return typed_opcode(op, type);
+}
+
+static bool is_immediate(node* n, int min, int max, long* l) {
+  if (n->type != NODE_LONG)
+    return false;
+  *l = n->lval;
+  return min <= *l && *l <= max;
+}
+
+static variable_index lookup_local_ident(env* e, node* n) {
   variable_index vi;
-  if (fargs != NULL) {
-    count += let_args(e, fargs->cdr);
-    vi = lookup(e, (char*)fargs->car, true);
-    addcode(e, MK_OP_A(OP_LET_LOCAL, vi.index)); ++count;
+  vi.global = true;
+  vi.index = -1;
+  if (n->type == NODE_IDENTIFIER)
+    vi = lookup(e, n->name, false);
+  return vi;
+}
+
+static uint32_t codegen_operands(env* e, node* lhs, node* rhs) {
+  uint32_t count = 0;
+  variable_index vi = lookup_local_ident(e, lhs), wi = lookup_local_ident(e, rhs);
+  if (!vi.global && !wi.global && vi.index >= 0 && wi.index >= 0 && wi.index <= 0x7fffff) {
+    addcode(e, MK_OP_AB(OP_LOAD_LOCAL_IDENT2, vi.index, wi.index)); ++count;
+  } else {
+    count += codegen(e, lhs);
+    count += codegen(e, rhs);
   }
   return count;
 }
 
-static uint16_t codegen(env* e, node* n) {
-  uint16_t count = 0;
-  switch (intn(n->car)) {
+static uint32_t codegen_jmp_ifnot(env* e, node* n, uint32_t* index) {
+  uint32_t count = 0, op;
+  if (n->type == NODE_BINOP) {
+    switch (n->op) {
+      case GT: op = OP_JMP_IFNOT_GT; break;
+      case GE: op = OP_JMP_IFNOT_GE; break;
+      case EQEQ: op = OP_JMP_IFNOT_EQEQ; break;
+      case NEQ: op = OP_JMP_IFNOT_NEQ; break;
+      case LT: op = OP_JMP_IFNOT_LT; break;
+      case LE: op = OP_JMP_IFNOT_LE; break;
+      default: op = OP_JMP_IFNOT; break;
+    }
+    if (op != OP_JMP_IFNOT) {
+      count += codegen_operands(e, n->lhs, n->rhs);
+      *index = addcode(e, specialize(e, op, n->lhs, n->rhs)); ++count;
+      return count;
+    }
+  }
+  count += codegen(e, n);
+  *index = addcode(e, OP_JMP_IFNOT); ++count;
+  return count;
+}
+
+// Calls of user functions use op, which is either OP_CALL or OP_TAILCALL.
+static uint32_t codegen_call(env* e, node* n, int op) {
+  uint32_t count = 0, num = 0, i;
+  variable_index vi;
+  vi = lookup(e, n->name, false);
+  if (vi.index >= 0) {
+    i = vi.index;
+  } else {
+    op = OP_FCALL;
+    for (i = 0; i < sizeof(gfuncs) / sizeof(func); ++i) {
+      if (gfuncs[i].name == n->name)
+        break;
+    }
+    if (i == sizeof(gfuncs) / sizeof(func)) {
+      printf("Unknown function: %s\n", n->name);
+      exit(1);
+    }
+  }
+  node* m = n->args;
+  while (m != NULL) {
+    ++num;
+    count += codegen(e, m);
+    m = m->next;
+  }
+  addcode(e, MK_OP_AB(op, i, num)); ++count;
+  return count;
+}
+
+static uint32_t codegen(env* e, node* n) {
+  uint32_t count = 0;
+  switch (n->type) {
     case NODE_FUNCTION: {
-      constant_value v; v.lval = e->codesidx + 3;
-      variable_index vi = lookup(e, (char*)n->cdr->car, true);
-      addcode(e, MK_OP_A(OP_LOAD_LONG, addconstant(e, v))); ++count;
+      constant_value v;
+      variable_index vi = lookup(e, n->name, true);
+      addcode(e, MK_OP_A(OP_LOAD_FUNC, 2)); ++count;
       addcode(e, MK_OP_A(OP_LET, vi.index)); ++count;
-      e->local_variables = calloc(128, sizeof(variable));
-      e->local_variables_len = 0;
-      uint16_t save_func_pc = e->func_pc; e->func_pc = e->codesidx;
-      uint16_t index1, index2, index3, index4;
+      new_local_variables(e);
+      e->local_variable_types = e->function_types[e->functionsidx++];
+      uint32_t index1, index2, save_for_depth = e->for_depth; int params;
+      e->for_depth = 0;
       index1 = addcode(e, OP_JMP); ++count;
-      index2 = addcode(e, OP_RET); ++count;
-      index3 = addcode(e, OP_ALLOC); ++count;
-      index4 = addcode(e, OP_LET_LOCAL); ++count;
-      count += let_args(e, n->cdr->cdr->car);
-      count += codegen(e, n->cdr->cdr->cdr);
+      index2 = addcode(e, OP_ENTER); ++count;
+      params = declare_args(e, n->params);
+      count += codegen(e, n->body);
       v.lval = 0;
       addcode(e, MK_OP_A(OP_LOAD_LONG, addconstant(e, v))); ++count;
-      addcode(e, MK_OP_A(OP_JMP, - (long)(e->codesidx - e->func_pc))); ++count;
-      operand(e, index1, e->codesidx - e->func_pc - 1);
-      operand(e, index2, e->local_variables_len + 1);
-      operand(e, index3, e->local_variables_len + 1);
-      operand(e, index4, e->local_variables_len);
+      addcode(e, OP_RETURN); ++count;
+      operand(e, index1, e->codesidx - index1 - 1);
+      e->codes[index2] = MK_OP_AB(OP_ENTER, e->local_variables_len, params);
       free(e->local_variables);
       e->local_variables = NULL;
       e->local_variables_len = 0;
-      e->func_pc = save_func_pc;
+      e->local_variable_types = NULL;
+      e->for_depth = save_for_depth;
       break;
     }
-    case NODE_RETURN:
-      count += codegen(e, n->cdr);
-      addcode(e, MK_OP_A(OP_JMP, - (long)(e->codesidx - e->func_pc))); ++count;
+    case NODE_RETURN: {
+      uint32_t k;
+      if (e->local_variables == NULL) {
+        printf("return outside of function\n");
+        exit(1);
+      }
+      // Each enclosing for loop keeps its limit and step on the stack.
+      for (k = 0; k < e->for_depth * 2; ++k) {
+        addcode(e, OP_POP); ++count;
+      }
+      if (n->expr->type == NODE_FCALL && lookup(e, n->expr->name, false).index >= 0) {
+        count += codegen_call(e, n->expr, OP_TAILCALL);
+        break;
+      }
+      count += codegen(e, n->expr);
+      addcode(e, OP_RETURN); ++count;
       break;
+    }
     case NODE_STMTS:
-      n = n->cdr;
-      while (n != NULL) {
-        count += codegen(e, n->car);
-        n = n->cdr;
-      }
+      for (n = n->stmts; n != NULL; n = n->next)
+        count += codegen(e, n);
       break;
     case NODE_ASSIGN: {
-      variable_index vi = lookup(e, (char*)n->cdr->car, true);
-      count += codegen(e, n->cdr->cdr);
+      variable_index vi = lookup(e, n->name, true);
+      node* m = n->expr; long l;
+      if (m->type == NODE_BINOP && (m->op == PLUS || m->op == MINUS) &&
+          m->lhs->type == NODE_IDENTIFIER && m->lhs->name == n->name &&
+          is_immediate(m->rhs, -INT8_MAX, INT8_MAX, &l)) {
+        l = m->op == PLUS ? l : -l;
+        addcode(e, MK_OP_AB(specialize(e, vi.global ? OP_INC : OP_INC_LOCAL, m->lhs, m->rhs), vi.index, l)); ++count;
+        break;
+      }
+      count += codegen(e, m);
       addcode(e, MK_OP_A(vi.global ? OP_LET : OP_LET_LOCAL, vi.index)); ++count;
       break;
     }
     case NODE_IF: {
-      int16_t diff0, diff1; uint16_t index0, index1;
-      count += codegen(e, n->cdr->car);
-      index0 = addcode(e, OP_JMP_IFNOT); ++count;
-      count += (diff0 = codegen(e, n->cdr->cdr->car));
-      if (n->cdr->cdr->cdr != NULL) {
+      int32_t diff0, diff1; uint32_t index0, index1;
+      count += codegen_jmp_ifnot(e, n->cond, &index0);
+      count += (diff0 = codegen(e, n->body));
+      if (n->orelse != NULL) {
         index1 = addcode(e, OP_JMP); ++count;
-        count += (diff1 = codegen(e, n->cdr->cdr->cdr));
+        count += (diff1 = codegen(e, n->orelse));
         operand(e, index1, diff1);
         ++diff0;
       }
@@ -182,19 +423,58 @@ static uint16_t codegen(env* e, node* n) {
       break;
     }
     case NODE_WHILE: {
-      uint16_t save_while_pc = e->while_pc; e->while_pc = e->codesidx;
-      int16_t diff0, diff1; uint16_t index0, index1;
+      uint32_t save_while_pc = e->while_pc; e->while_pc = e->codesidx;
+      int32_t diff0, diff1; uint32_t index0, index1;
       addcode(e, MK_OP_A(OP_JMP, 1)); ++count;
       index0 = addcode(e, OP_JMP); ++count;
-      count += (diff0 = codegen(e, n->cdr->car));
-      index1 = addcode(e, OP_JMP_IFNOT); ++count;
-      count += (diff1 = codegen(e, n->cdr->cdr));
-      addcode(e, MK_OP_A(OP_JMP, -(diff0 + diff1 + 2))); ++count;
-      operand(e, index0, diff0 + diff1 + 2);
+      count += (diff0 = codegen_jmp_ifnot(e, n->cond, &index1));
+      count += (diff1 = codegen(e, n->body));
+      addcode(e, MK_OP_A(OP_JMP, -(diff0 + diff1 + 1))); ++count;
+      operand(e, index0, diff0 + diff1 + 1);
       operand(e, index1, diff1 + 1);
       e->while_pc = save_while_pc;
       break;
     }
+    case NODE_FOR: {
+      // The counter is the loop variable and the limit and the step stay on
+      // the stack. They are evaluated before the start is assigned, so that
+      // they see the variable as it was before the loop. forprep skips the
+      // loop when the range is empty, and forloop steps the counter and jumps
+      // back while it is within the limit. Like a while loop, the two jumps
+      // after while_pc are for break and continue.
+      uint32_t save_while_pc = e->while_pc, start = e->codesidx, index0, index1, index2, index3;
+      variable_index vi = lookup(e, n->name, true);
+      constant_value v;
+      if (vi.index > 0x7fffff) {
+        printf("Too many variables\n");
+        exit(1);
+      }
+      codegen(e, n->args->next);
+      if (n->args->next->next != NULL) {
+        codegen(e, n->args->next->next);
+      } else {
+        v.lval = 1;
+        addcode(e, MK_OP_A(OP_LOAD_LONG, addconstant(e, v)));
+      }
+      codegen(e, n->args);
+      addcode(e, MK_OP_A(vi.global ? OP_LET : OP_LET_LOCAL, vi.index));
+      e->while_pc = addcode(e, MK_OP_A(OP_JMP, 2));
+      index0 = addcode(e, OP_JMP);
+      index1 = addcode(e, OP_JMP);
+      index2 = addcode(e, MK_OP_AB(vi.global ? OP_FORPREP : OP_FORPREP_LOCAL, 0, vi.index));
+      e->for_depth++;
+      codegen(e, n->body);
+      e->for_depth--;
+      index3 = addcode(e, MK_OP_AB(vi.global ? OP_FORLOOP : OP_FORLOOP_LOCAL, index2 - e->codesidx, vi.index));
+      operand(e, index0, e->codesidx - index0 - 1);
+      operand(e, index1, index3 - index1 - 1);
+      operand(e, index2, e->codesidx - index2 - 1);
+      addcode(e, OP_POP);
+      addcode(e, OP_POP);
+      e->while_pc = save_while_pc;
+      count = e->codesidx - start;
+      break;
+    }
     case NODE_BREAK:
       addcode(e, MK_OP_A(OP_JMP, - (long)(e->codesidx - e->while_pc))); ++count;
       break;
@@ -202,39 +482,15 @@ static uint16_t codegen(env* e, node* n) {
       addcode(e, MK_OP_A(OP_JMP, - (long)(e->codesidx - e->while_pc - 1))); ++count;
       break;
     case NODE_PRINT:
-      count += codegen(e, n->cdr);
+      count += codegen(e, n->expr);
       addcode(e, OP_PRINT); ++count;
       break;
-    case NODE_FCALL: {
-      uint16_t num = 0, op, i;
-      variable_index vi;
-      vi = lookup(e, (char*)n->cdr->car, false);
-      if (vi.index >= 0) {
-        op = OP_UFCALL;
-        i = vi.index;
-      } else {
-        op = OP_FCALL;
-        for (i = 0; i < sizeof(gfuncs) / sizeof(func); ++i) {
-          if (!strcmp(gfuncs[i].name, (char*)n->cdr->car))
-            break;
-        }
-        if (i == sizeof(gfuncs) / sizeof(func)) {
-          printf("Unknown function: %s\n", (char*)n->cdr->car);
-          exit(1);
-        }
-      }
-      node* m = n->cdr->cdr;
-      while (m != NULL) {
-        ++num;
-        count += codegen(e, m->car);
-        m = m->cdr;
-      }
-      addcode(e, MK_OP_AB(op, i, num)); ++count;
+    case NODE_FCALL:
+      count += codegen_call(e, n, OP_CALL);
       break;
-    }
     case NODE_UNARYOP:
-      count += codegen(e, n->cdr->cdr);
-      switch (intn(n->cdr->car)) {
+      count += codegen(e, n->expr);
+      switch (n->op) {
         case NOT: addcode(e, OP_UNOT); break;
         case PLUS: addcode(e, OP_UADD); break;
         case MINUS: addcode(e, OP_UMINUS); break;
@@ -242,168 +498,251 @@ static uint16_t codegen(env* e, node* n) {
       };
       ++count;
       break;
-    case NODE_BINOP:
-      count += codegen(e, n->cdr->cdr->car);
-      if (intn(n->cdr->car) == AND) {
-        int16_t diff; uint16_t index;
+    case NODE_BINOP: {
+      long l;
+      if (n->op != AND && n->op != OR &&
+          (n->op == TIMES || n->op == DIVIDE || !is_immediate(n->rhs, INT16_MIN, INT16_MAX, &l))) {
+        uint8_t op;
+        count += codegen_operands(e, n->lhs, n->rhs);
+        switch (n->op) {
+          case PLUS: op = OP_ADD; break;
+          case MINUS: op = OP_MINUS; break;
+          case TIMES: op = OP_TIMES; break;
+          case DIVIDE: op = OP_DIVIDE; break;
+          case GT: op = OP_GT; break;
+          case GE: op = OP_GE; break;
+          case EQEQ: op = OP_EQEQ; break;
+          case NEQ: op = OP_NEQ; break;
+          case LT: op = OP_LT; break;
+          case LE: op = OP_LE; break;
+          default: printf("Unknown binary operator\n"); exit(1);
+        }
+        addcode(e, specialize(e, op, n->lhs, n->rhs)); ++count;
+        break;
+      }
+      count += codegen(e, n->lhs);
+      if (n->op == AND) {
+        int32_t diff; uint32_t index;
         addcode(e, OP_DUP); ++count;
         index = addcode(e, OP_JMP_IFNOT); ++count;
         addcode(e, OP_POP); ++count;
-        count += (diff = codegen(e, n->cdr->cdr->cdr));
+        count += (diff = codegen(e, n->rhs));
         operand(e, index, diff + 1);
-      } else if (intn(n->cdr->car) == OR) {
-        int16_t diff; uint16_t index;
+      } else if (n->op == OR) {
+        int32_t diff; uint32_t index;
         addcode(e, OP_DUP); ++count;
         index = addcode(e, OP_JMP_IF); ++count;
         addcode(e, OP_POP); ++count;
-        count += (diff = codegen(e, n->cdr->cdr->cdr));
+        count += (diff = codegen(e, n->rhs));
         operand(e, index, diff + 1);
-      } else if ((intn(n->cdr->car) == PLUS || intn(n->cdr->car) == MINUS) && intn(n->cdr->cdr->cdr->car) == NODE_LONG) {
-        addcode(e, MK_OP_A(intn(n->cdr->car) == PLUS ? OP_IADD : OP_IMINUS, atol((char*)(n->cdr->cdr->cdr->cdr)))); ++count;
       } else {
-        count += codegen(e, n->cdr->cdr->cdr);
-        switch (intn(n->cdr->car)) {
-          case PLUS: addcode(e, OP_ADD); break;
-          case MINUS: addcode(e, OP_MINUS); break;
-          case TIMES: addcode(e, OP_TIMES); break;
-          case DIVIDE: addcode(e, OP_DIVIDE); break;
-          case GT: addcode(e, OP_GT); break;
-          case GE: addcode(e, OP_GE); break;
-          case EQEQ: addcode(e, OP_EQEQ); break;
-          case NEQ: addcode(e, OP_NEQ); break;
-          case LT: addcode(e, OP_LT); break;
-          case LE: addcode(e, OP_LE); break;
+        uint8_t op;
+        switch (n->op) {
+          case PLUS: op = OP_IADD; break;
+          case MINUS: op = OP_IMINUS; break;
+          case GT: op = OP_IGT; break;
+          case GE: op = OP_IGE; break;
+          case EQEQ: op = OP_IEQEQ; break;
+          case NEQ: op = OP_INEQ; break;
+          case LT: op = OP_ILT; break;
+          case LE: op = OP_ILE; break;
           default: printf("Unknown binary operator\n"); exit(1);
         }
-        ++count;
+        addcode(e, MK_OP_A(specialize(e, op, n->lhs, n->rhs), l)); ++count;
       }
       break;
+    }
     case NODE_BOOL: {
-      constant_value v; v.bval = (bool)((intptr_t)n->cdr == 1);
+      constant_value v; v.bval = n->bval;
       addcode(e, MK_OP_A(OP_LOAD_BOOL, addconstant(e, v))); ++count;
       break;
     }
     case NODE_LONG: {
-      constant_value v; v.lval = atol((char*)n->cdr);
+      constant_value v; v.lval = n->lval;
       addcode(e, MK_OP_A(OP_LOAD_LONG, addconstant(e, v))); ++count;
       break;
     }
     case NODE_DOUBLE: {
-      constant_value v; v.dval = strtod((char*)n->cdr, NULL);
+      constant_value v; v.dval = n->dval;
       addcode(e, MK_OP_A(OP_LOAD_DOUBLE, addconstant(e, v))); ++count;
       break;
     }
     case NODE_IDENTIFIER: {
       variable_index vi;
-      vi = lookup(e, (char*)n->cdr, false);
+      vi = lookup(e, n->name, false);
       if (vi.index < 0) {
-        printf("Unknown variable: %s\n", (char*)n->cdr);
+        printf("Unknown variable: %s\n", n->name);
         exit(1);
       }
       addcode(e, MK_OP_A(vi.global ? OP_LOAD_IDENT : OP_LOAD_LOCAL_IDENT, vi.index)); ++count;
       break;
     }
     default:
-      printf("Unknown node %d\n", intn(n->car));
+      printf("Unknown node %d\n", n->type);
       exit(1);
   }
   return count;
 }
 
-#define UNARY_OP(op) \
-  do { \
-    value val = e->stack[--e->stackidx]; \
-    if (val.type == VT_DOUBLE) { \
-      e->stack[e->stackidx++].dval = op(val.dval); \
-      \
-    } else { \
-      e->stack[e->stackidx].type = VT_LONG; \
-      e->stack[e->stackidx++].lval = op(TO_LONG(val)); \
-    } \
-  } while(0);
-
-#define BINARY_OP(op) \
+#define QUICKEN_BINARY_OP(op_ll, op_dd) \
   do { \
-    value rhs = e->stack[--e->stackidx]; \
-    value lhs = e->stack[--e->stackidx]; \
-    if (lhs.type == VT_DOUBLE || rhs.type == VT_DOUBLE) { \
-      e->stack[e->stackidx].type = VT_DOUBLE; \
-      e->stack[e->stackidx++].dval = TO_DOUBLE(lhs) op TO_DOUBLE(rhs); \
-      \
-    } else { \
-      e->stack[e->stackidx].type = VT_LONG; \
-      e->stack[e->stackidx++].lval = TO_LONG(lhs) op TO_LONG(rhs); \
-    } \
+    value rhs = STACK_TOP; \
+    value lhs = STACK_SECOND; \
+    if (IS_LONG(lhs) && IS_LONG(rhs)) \
+      SET_OPCODE(e->codes[i], op_ll); \
+    else if (IS_DOUBLE(lhs) && IS_DOUBLE(rhs)) \
+      SET_OPCODE(e->codes[i], op_dd); \
   } while(0);
 
-#define IBINARY_OP(op) \
+#define GUARD_BINARY_OP(is_type, op) \
   do { \
-    value v = e->stack[--e->stackidx]; \
-    if (v.type == VT_DOUBLE) { \
-      e->stack[e->stackidx++].dval = v.dval op GET_ARG_A(e->codes[i]); \
-      \
-    } else { \
-      if (v.type != VT_LONG) \
-        e->stack[e->stackidx].type = VT_LONG; \
-      e->stack[e->stackidx++].lval = TO_LONG(v) op GET_ARG_A(e->codes[i]); \
+    if (!is_type(STACK_TOP) || !is_type(STACK_SECOND)) { \
+      SET_OPCODE(e->codes[i], op); \
+      REDISPATCH(); \
     } \
   } while(0);
 
-#define LOGICAL_BINARY_OP(op) \
-  do { \
-    value rhs = e->stack[--e->stackidx]; \
-    value lhs = e->stack[--e->stackidx]; \
-    e->stack[e->stackidx].type = VT_BOOL; \
-    if (lhs.type == VT_DOUBLE || rhs.type == VT_DOUBLE) { \
-      e->stack[e->stackidx++].bval = TO_DOUBLE(lhs) op TO_DOUBLE(rhs); \
-      \
-    } else { \
-      e->stack[e->stackidx++].bval = TO_LONG(lhs) op TO_LONG(rhs); \
-    } \
-  } while(0);
+static void print_code(FILE* fp, env* e, int i) {
+  switch (GET_OPCODE(e->codes[i])) {
+    case OP_POP: fprintf(fp, "pop\n"); break;
+    case OP_DUP: fprintf(fp, "dup\n"); break;
+    case OP_LET: fprintf(fp, "let %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_LET_LOCAL: fprintf(fp, "let_local %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP: fprintf(fp, "jmp %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IF: fprintf(fp, "jmp_if %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT: fprintf(fp, "jmp_ifnot %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GT: fprintf(fp, "jmp_ifnot_> %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GE: fprintf(fp, "jmp_ifnot_>= %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_EQEQ: fprintf(fp, "jmp_ifnot_== %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_NEQ: fprintf(fp, "jmp_ifnot_!= %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LT: fprintf(fp, "jmp_ifnot_< %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LE: fprintf(fp, "jmp_ifnot_<= %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GT_LL: fprintf(fp, "jmp_ifnot_>_ll %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GE_LL: fprintf(fp, "jmp_ifnot_>=_ll %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_EQEQ_LL: fprintf(fp, "jmp_ifnot_==_ll %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_NEQ_LL: fprintf(fp, "jmp_ifnot_!=_ll %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LT_LL: fprintf(fp, "jmp_ifnot_<_ll %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LE_LL: fprintf(fp, "jmp_ifnot_<=_ll %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GT_DD: fprintf(fp, "jmp_ifnot_>_dd %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GE_DD: fprintf(fp, "jmp_ifnot_>=_dd %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_EQEQ_DD: fprintf(fp, "jmp_ifnot_==_dd %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_NEQ_DD: fprintf(fp, "jmp_ifnot_!=_dd %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LT_DD: fprintf(fp, "jmp_ifnot_<_dd %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LE_DD: fprintf(fp, "jmp_ifnot_<=_dd %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GT_LONG: fprintf(fp, "jmp_ifnot_>_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GE_LONG: fprintf(fp, "jmp_ifnot_>=_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_EQEQ_LONG: fprintf(fp, "jmp_ifnot_==_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_NEQ_LONG: fprintf(fp, "jmp_ifnot_!=_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LT_LONG: fprintf(fp, "jmp_ifnot_<_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LE_LONG: fprintf(fp, "jmp_ifnot_<=_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GT_DOUBLE: fprintf(fp, "jmp_ifnot_>_double %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GE_DOUBLE: fprintf(fp, "jmp_ifnot_>=_double %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_EQEQ_DOUBLE: fprintf(fp, "jmp_ifnot_==_double %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_NEQ_DOUBLE: fprintf(fp, "jmp_ifnot_!=_double %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LT_DOUBLE: fprintf(fp, "jmp_ifnot_<_double %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LE_DOUBLE: fprintf(fp, "jmp_ifnot_<=_double %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_FORPREP: fprintf(fp, "forprep %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_FORPREP_LOCAL: fprintf(fp, "forprep_local %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_FORLOOP: fprintf(fp, "forloop %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_FORLOOP_LOCAL: fprintf(fp, "forloop_local %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_CALL: fprintf(fp, "call %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_TAILCALL: fprintf(fp, "tailcall %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_ENTER: fprintf(fp, "enter %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_RETURN: fprintf(fp, "return\n"); break;
+    case OP_PRINT: fprintf(fp, "print\n"); break;
+    case OP_FCALL: fprintf(fp, "fcall %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_UNOT: fprintf(fp, "u!\n"); break;
+    case OP_UADD: fprintf(fp, "u+\n"); break;
+    case OP_UMINUS: fprintf(fp, "u-\n"); break;
+    case OP_ADD: fprintf(fp, "+\n"); break;
+    case OP_MINUS: fprintf(fp, "-\n"); break;
+    case OP_TIMES: fprintf(fp, "*\n"); break;
+    case OP_DIVIDE: fprintf(fp, "/\n"); break;
+    case OP_ADD_LL: fprintf(fp, "+_ll\n"); break;
+    case OP_MINUS_LL: fprintf(fp, "-_ll\n"); break;
+    case OP_TIMES_LL: fprintf(fp, "*_ll\n"); break;
+    case OP_DIVIDE_LL: fprintf(fp, "/_ll\n"); break;
+    case OP_ADD_DD: fprintf(fp, "+_dd\n"); break;
+    case OP_MINUS_DD: fprintf(fp, "-_dd\n"); break;
+    case OP_TIMES_DD: fprintf(fp, "*_dd\n"); break;
+    case OP_DIVIDE_DD: fprintf(fp, "/_dd\n"); break;
+    case OP_ADD_LONG: fprintf(fp, "+_long\n"); break;
+    case OP_MINUS_LONG: fprintf(fp, "-_long\n"); break;
+    case OP_TIMES_LONG: fprintf(fp, "*_long\n"); break;
+    case OP_DIVIDE_LONG: fprintf(fp, "/_long\n"); break;
+    case OP_ADD_DOUBLE: fprintf(fp, "+_double\n"); break;
+    case OP_MINUS_DOUBLE: fprintf(fp, "-_double\n"); break;
+    case OP_TIMES_DOUBLE: fprintf(fp, "*_double\n"); break;
+    case OP_DIVIDE_DOUBLE: fprintf(fp, "/_double\n"); break;
+    case OP_IADD: fprintf(fp, "iadd %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_IMINUS: fprintf(fp, "iminus %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_IADD_LONG: fprintf(fp, "iadd_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_IMINUS_LONG: fprintf(fp, "iminus_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_INC: fprintf(fp, "inc %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_INC_LOCAL: fprintf(fp, "inc_local %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_INC_LONG: fprintf(fp, "inc_long %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_INC_LOCAL_LONG: fprintf(fp, "inc_local_long %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_GT: fprintf(fp, ">\n"); break;
+    case OP_GE: fprintf(fp, ">=\n"); break;
+    case OP_EQEQ: fprintf(fp, "==\n"); break;
+    case OP_NEQ: fprintf(fp, "!=\n"); break;
+    case OP_LT: fprintf(fp, "<\n"); break;
+    case OP_LE: fprintf(fp, "<=\n"); break;
+    case OP_GT_LL: fprintf(fp, ">_ll\n"); break;
+    case OP_GE_LL: fprintf(fp, ">=_ll\n"); break;
+    case OP_EQEQ_LL: fprintf(fp, "==_ll\n"); break;
+    case OP_NEQ_LL: fprintf(fp, "!=_ll\n"); break;
+    case OP_LT_LL: fprintf(fp, "<_ll\n"); break;
+    case OP_LE_LL: fprintf(fp, "<=_ll\n"); break;
+    case OP_GT_DD: fprintf(fp, ">_dd\n"); break;
+    case OP_GE_DD: fprintf(fp, ">=_dd\n"); break;
+    case OP_EQEQ_DD: fprintf(fp, "==_dd\n"); break;
+    case OP_NEQ_DD: fprintf(fp, "!=_dd\n"); break;
+    case OP_LT_DD: fprintf(fp, "<_dd\n"); break;
+    case OP_LE_DD: fprintf(fp, "<=_dd\n"); break;
+    case OP_GT_LONG: fprintf(fp, ">_long\n"); break;
+    case OP_GE_LONG: fprintf(fp, ">=_long\n"); break;
+    case OP_EQEQ_LONG: fprintf(fp, "==_long\n"); break;
+    case OP_NEQ_LONG: fprintf(fp, "!=_long\n"); break;
+    case OP_LT_LONG: fprintf(fp, "<_long\n"); break;
+    case OP_LE_LONG: fprintf(fp, "<=_long\n"); break;
+    case OP_GT_DOUBLE: fprintf(fp, ">_double\n"); break;
+    case OP_GE_DOUBLE: fprintf(fp, ">=_double\n"); break;
+    case OP_EQEQ_DOUBLE: fprintf(fp, "==_double\n"); break;
+    case OP_NEQ_DOUBLE: fprintf(fp, "!=_double\n"); break;
+    case OP_LT_DOUBLE: fprintf(fp, "<_double\n"); break;
+    case OP_LE_DOUBLE: fprintf(fp, "<=_double\n"); break;
+    case OP_IGT: fprintf(fp, "i> %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_IGE: fprintf(fp, "i>= %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_IEQEQ: fprintf(fp, "i== %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_INEQ: fprintf(fp, "i!= %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_ILT: fprintf(fp, "i< %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_ILE: fprintf(fp, "i<= %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_IGT_LONG: fprintf(fp, "i>_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_IGE_LONG: fprintf(fp, "i>=_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_IEQEQ_LONG: fprintf(fp, "i==_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_INEQ_LONG: fprintf(fp, "i!=_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_ILT_LONG: fprintf(fp, "i<_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_ILE_LONG: fprintf(fp, "i<=_long %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_LOAD_BOOL:
+      if (e->constants[GET_ARG_A(e->codes[i])].bval)
+        fprintf(fp, "bool true\n");
+      else
+        fprintf(fp, "bool false\n");
+      break;
+    case OP_LOAD_LONG: fprintf(fp, "long %ld\n", e->constants[GET_ARG_A(e->codes[i])].lval); break;
+    case OP_LOAD_DOUBLE: fprintf(fp, "double %.9lf\n", e->constants[GET_ARG_A(e->codes[i])].dval); break;
+    case OP_LOAD_IDENT: fprintf(fp, "load %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_LOAD_LOCAL_IDENT: fprintf(fp, "load_local %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_LOAD_FUNC: fprintf(fp, "func %d\n", GET_ARG_A(e->codes[i])); break;
+    case OP_LOAD_LOCAL_IDENT2: fprintf(fp, "load_local2 %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
+    case OP_HALT: fprintf(fp, "halt\n"); break;
+    default: fprintf(fp, "Unknown opcode %d\n", GET_OPCODE(e->codes[i])); exit(1);
+  }
+}
 
 static void print_codes(env* e) {
   int i;
-  for (i = 0; i < e->codesidx; i++) {
-    switch (GET_OPCODE(e->codes[i])) {
-      case OP_POP: printf("pop\n"); break;
-      case OP_DUP: printf("dup\n"); break;
-      case OP_LET: printf("let %d\n", GET_ARG_A(e->codes[i])); break;
-      case OP_LET_LOCAL: printf("let_local %d\n", GET_ARG_A(e->codes[i])); break;
-      case OP_JMP: printf("jmp %d\n", GET_ARG_A(e->codes[i])); break;
-      case OP_JMP_IF: printf("jmp_if %d\n", GET_ARG_A(e->codes[i])); break;
-      case OP_JMP_IFNOT: printf("jmp_ifnot %d\n", GET_ARG_A(e->codes[i])); break;
-      case OP_UFCALL: printf("ufcall %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
-      case OP_ALLOC: printf("alloc %d\n", GET_ARG_A(e->codes[i])); break;
-      case OP_RET: printf("ret %d\n", GET_ARG_A(e->codes[i])); break;
-      case OP_PRINT: printf("print\n"); break;
-      case OP_FCALL: printf("fcall %d %d\n", GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i])); break;
-      case OP_UNOT: printf("u!\n"); break;
-      case OP_UADD: printf("u+\n"); break;
-      case OP_UMINUS: printf("u-\n"); break;
-      case OP_ADD: printf("+\n"); break;
-      case OP_MINUS: printf("-\n"); break;
-      case OP_TIMES: printf("*\n"); break;
-      case OP_DIVIDE: printf("/\n"); break;
-      case OP_IADD: printf("iadd %d\n", GET_ARG_A(e->codes[i])); break;
-      case OP_IMINUS: printf("iminus %d\n", GET_ARG_A(e->codes[i])); break;
-      case OP_GT: printf(">\n"); break;
-      case OP_GE: printf(">=\n"); break;
-      case OP_EQEQ: printf("==\n"); break;
-      case OP_NEQ: printf("!=\n"); break;
-      case OP_LT: printf("<\n"); break;
-      case OP_LE: printf("<=\n"); break;
-      case OP_LOAD_BOOL:
-        if (e->constants[GET_ARG_A(e->codes[i])].bval)
-          printf("bool true\n");
-        else
-          printf("bool false\n");
-        break;
-      case OP_LOAD_LONG: printf("long %ld\n", e->constants[GET_ARG_A(e->codes[i])].lval); break;
-      case OP_LOAD_DOUBLE: printf("double %.9lf\n", e->constants[GET_ARG_A(e->codes[i])].dval); break;
-      case OP_LOAD_IDENT: printf("load %d\n", GET_ARG_A(e->codes[i])); break;
-      case OP_LOAD_LOCAL_IDENT: printf("load_local %d\n", GET_ARG_A(e->codes[i])); break;
-      default: printf("Unknown opcode %d\n", GET_OPCODE(e->codes[i])); exit(1);
-    }
-  }
+  for (i = 0; i < e->codesidx; i++)
+    print_code(stdout, e, i);
 }
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <math.h>
+#include "opcode.h"
+#include "vm.h"
+
+static void emit_c_long(long l) {
+  if (l == LONG_MIN)
+    printf("LONG_MIN");
+  else
+    printf("%ldL", l);
+}
+
+static void emit_c_double(double d) {
+  if (isnan(d))
+    printf("%sNAN", signbit(d) ? "-" : "");
+  else if (isinf(d))
+    printf("%sHUGE_VAL", d < 0 ? "-" : "");
+  else
+    printf("%a", d);
+}
+
+#define EMIT_C_BINARY(op, c) \
+  case OP_##op: case OP_##op##_LL: case OP_##op##_DD: \
+    printf("  BINARY_OP(%s);\n", c); break; \
+  case OP_##op##_LONG: printf("  SPECIALIZED_BINARY_OP(AS_LONG, LONG_VAL, %s);\n", c); break; \
+  case OP_##op##_DOUBLE: printf("  SPECIALIZED_BINARY_OP(AS_DOUBLE, DOUBLE_VAL, %s);\n", c); break;
+#define EMIT_C_LOGICAL(op, c) \
+  case OP_##op: case OP_##op##_LL: case OP_##op##_DD: \
+    printf("  LOGICAL_BINARY_OP(%s);\n", c); break; \
+  case OP_##op##_LONG: printf("  SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, %s);\n", c); break; \
+  case OP_##op##_DOUBLE: printf("  SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, %s);\n", c); break;
+#define EMIT_C_JMP_IFNOT(op, c) \
+  case OP_JMP_IFNOT_##op: case OP_JMP_IFNOT_##op##_LL: case OP_JMP_IFNOT_##op##_DD: \
+    printf("  JMP_IFNOT_BINARY_OP(%s, goto L%d);\n", c, i + a + 1); break; \
+  case OP_JMP_IFNOT_##op##_LONG: \
+    printf("  SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, %s, goto L%d);\n", c, i + a + 1); break; \
+  case OP_JMP_IFNOT_##op##_DOUBLE: \
+    printf("  SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, %s, goto L%d);\n", c, i + a + 1); break;
+#define EMIT_C_IMMEDIATE(op, f, type_val, c) \
+  case OP_##op: printf("  " f "(%s, %d);\n", c, a); break; \
+  case OP_##op##_LONG: printf("  SPECIALIZED_IBINARY_OP(" type_val ", %s, %d);\n", c, a); break;
+
+// Prints the program as a standalone C source with one label per instruction.
+// Calls jump through a switch over the function entries verify_codes found,
+// and returns through one over the pcs after the calls.
+static void emit_c(env* e) {
+  int i, a, b;
+  bool* returns = calloc(e->codesidx + 1, sizeof(bool));
+  for (i = 0; i < e->codesidx; ++i)
+    if (GET_OPCODE(e->codes[i]) == OP_CALL)
+      returns[i + 1] = true;
+  printf("/* Generated by minivm --emit-c. */\n");
+  printf("#include <stdlib.h>\n");
+  printf("#include <limits.h>\n");
+  printf("#include <math.h>\n");
+  printf("#include \"vm.h\"\n");
+  printf("#include \"func.c\"\n\n");
+  printf("#pragma GCC diagnostic ignored \"-Wunused-label\"\n\n");
+  printf("int main(void) {\n");
+  printf("  env en, *e = &en;\n");
+  printf("  long i;\n");
+  printf("  uint32_t base = %d;\n", (int)e->variableslen);
+  printf("  (void)base;\n");
+  printf("  init_output();\n");
+  printf("  e->stack_depth = %d;\n", (int)e->stack_depth);
+  printf("  e->frame_depth = %d;\n", (int)e->frame_depth);
+  printf("  alloc_stack(e);\n");
+  printf("  e->stackidx = 0;\n");
+  printf("  e->variablescap = %d;\n", (int)e->variablescap);
+  printf("  e->variables = calloc(e->variablescap, sizeof(variable));\n");
+  printf("  for (i = 0; i < e->variablescap; ++i)\n");
+  printf("    e->variables[i].value = BOOL_VAL(false);\n");
+  printf("  e->variableslen = %d;\n", (int)e->variableslen);
+  printf("  init_frames(e);\n");
+  for (i = 0; i < e->codesidx; ++i) {
+    a = GET_ARG_A(e->codes[i]);
+    b = GET_ARG_B(e->codes[i]);
+    printf("L%d:\n", i);
+    switch (GET_OPCODE(e->codes[i])) {
+      case OP_POP: printf("  --e->stackidx;\n"); break;
+      case OP_DUP:
+        printf("  e->stack[e->stackidx] = e->stack[e->stackidx - 1];\n");
+        printf("  ++e->stackidx;\n");
+        break;
+      case OP_LET: printf("  e->variables[%d].value = e->stack[--e->stackidx];\n", a); break;
+      case OP_LET_LOCAL: printf("  e->variables[base + %d].value = e->stack[--e->stackidx];\n", a); break;
+      case OP_JMP: printf("  goto L%d;\n", i + a + 1); break;
+      case OP_JMP_IF: printf("  if (evaluate_bool(e))\n    goto L%d;\n", i + a + 1); break;
+      case OP_JMP_IFNOT: printf("  if (!evaluate_bool(e))\n    goto L%d;\n", i + a + 1); break;
+      EMIT_C_JMP_IFNOT(GT, ">")
+      EMIT_C_JMP_IFNOT(GE, ">=")
+      EMIT_C_JMP_IFNOT(EQEQ, "==")
+      EMIT_C_JMP_IFNOT(NEQ, "!=")
+      EMIT_C_JMP_IFNOT(LT, "<")
+      EMIT_C_JMP_IFNOT(LE, "<=")
+      case OP_FORPREP: case OP_FORPREP_LOCAL:
+        printf("  if (!for_prep(e->variables[%s%d].value, e->stack[e->stackidx - 2], e->stack[e->stackidx - 1]))\n",
+            GET_OPCODE(e->codes[i]) == OP_FORPREP ? "" : "base + ", b);
+        printf("    goto L%d;\n", i + a + 1);
+        break;
+      case OP_FORLOOP: case OP_FORLOOP_LOCAL:
+        printf("  if (for_loop(&e->variables[%s%d].value, e->stack[e->stackidx - 2], e->stack[e->stackidx - 1]))\n",
+            GET_OPCODE(e->codes[i]) == OP_FORLOOP ? "" : "base + ", b);
+        printf("    goto L%d;\n", i + a + 1);
+        break;
+      case OP_CALL:
+        printf("  if (!IS_LONG(e->variables[%d].value))\n    not_a_function();\n", a);
+        printf("  i = AS_LONG(e->variables[%d].value);\n", a);
+        printf("  base = call_frame(e, %d, %d);\n", i, b);
+        printf("  goto call;\n");
+        break;
+      case OP_TAILCALL:
+        printf("  if (!IS_LONG(e->variables[%d].value))\n    not_a_function();\n", a);
+        printf("  i = AS_LONG(e->variables[%d].value);\n", a);
+        printf("  tail_call_frame(e, %d);\n", b);
+        printf("  goto call;\n");
+        break;
+      case OP_ENTER: printf("  enter_frame(e, %d, %d);\n", a, b); break;
+      case OP_RETURN:
+        printf("  i = e->frames[--e->framesidx].pc + 1;\n");
+        printf("  base = e->frames[e->framesidx - 1].base;\n");
+        printf("  goto dispatch;\n");
+        break;
+      case OP_PRINT: printf("  print_value(e->stack[--e->stackidx]);\n"); break;
+      case OP_FCALL:
+        printf("  gfuncs[%d].func(e, &e->stack[e->stackidx -= %d], %d);\n", a, b, b);
+        break;
+      case OP_UNOT:
+        printf("  e->stack[e->stackidx - 1] = BOOL_VAL(!TO_BOOL(e->stack[e->stackidx - 1]));\n");
+        break;
+      case OP_UADD: printf("  UNARY_OP(+);\n"); break;
+      case OP_UMINUS: printf("  UNARY_OP(-);\n"); break;
+      EMIT_C_BINARY(ADD, "+")
+      EMIT_C_BINARY(MINUS, "-")
+      EMIT_C_BINARY(TIMES, "*")
+      EMIT_C_BINARY(DIVIDE, "/")
+      EMIT_C_IMMEDIATE(IADD, "IBINARY_OP", "LONG_VAL", "+")
+      EMIT_C_IMMEDIATE(IMINUS, "IBINARY_OP", "LONG_VAL", "-")
+      case OP_INC: printf("  INC_OP(e->variables[%d].value, %d);\n", a, b); break;
+      case OP_INC_LOCAL: printf("  INC_OP(e->variables[base + %d].value, %d);\n", a, b); break;
+      case OP_INC_LONG: printf("  SPECIALIZED_INC_OP(e->variables[%d].value, %d);\n", a, b); break;
+      case OP_INC_LOCAL_LONG:
+        printf("  SPECIALIZED_INC_OP(e->variables[base + %d].value, %d);\n", a, b);
+        break;
+      EMIT_C_LOGICAL(GT, ">")
+      EMIT_C_LOGICAL(GE, ">=")
+      EMIT_C_LOGICAL(EQEQ, "==")
+      EMIT_C_LOGICAL(NEQ, "!=")
+      EMIT_C_LOGICAL(LT, "<")
+      EMIT_C_LOGICAL(LE, "<=")
+      EMIT_C_IMMEDIATE(IGT, "ILOGICAL_BINARY_OP", "BOOL_VAL", ">")
+      EMIT_C_IMMEDIATE(IGE, "ILOGICAL_BINARY_OP", "BOOL_VAL", ">=")
+      EMIT_C_IMMEDIATE(IEQEQ, "ILOGICAL_BINARY_OP", "BOOL_VAL", "==")
+      EMIT_C_IMMEDIATE(INEQ, "ILOGICAL_BINARY_OP", "BOOL_VAL", "!=")
+      EMIT_C_IMMEDIATE(ILT, "ILOGICAL_BINARY_OP", "BOOL_VAL", "<")
+      EMIT_C_IMMEDIATE(ILE, "ILOGICAL_BINARY_OP", "BOOL_VAL", "<=")
+      case OP_LOAD_BOOL:
+        printf("  e->stack[e->stackidx++] = BOOL_VAL(%s);\n", e->constants[a].bval ? "true" : "false");
+        break;
+      case OP_LOAD_LONG:
+        printf("  e->stack[e->stackidx++] = LONG_VAL(");
+        emit_c_long(e->constants[a].lval);
+        printf(");\n");
+        break;
+      case OP_LOAD_DOUBLE:
+        printf("  e->stack[e->stackidx++] = DOUBLE_VAL(");
+        emit_c_double(e->constants[a].dval);
+        printf(");\n");
+        break;
+      case OP_LOAD_IDENT: printf("  e->stack[e->stackidx++] = e->variables[%d].value;\n", a); break;
+      case OP_LOAD_LOCAL_IDENT:
+        printf("  e->stack[e->stackidx++] = e->variables[base + %d].value;\n", a);
+        break;
+      case OP_LOAD_LOCAL_IDENT2:
+        printf("  e->stack[e->stackidx++] = e->variables[base + %d].value;\n", a);
+        printf("  e->stack[e->stackidx++] = e->variables[base + %d].value;\n", b);
+        break;
+      case OP_LOAD_FUNC: printf("  e->stack[e->stackidx++] = LONG_VAL(%d);\n", i + a + 1); break;
+      case OP_HALT: printf("  goto halt;\n"); break;
+      default: printf("Unknown opcode %d\n", GET_OPCODE(e->codes[i])); exit(1);
+    }
+  }
+  printf("call:\n");
+  printf("  switch (i) {\n");
+  for (i = 0; i < e->codesidx; ++i)
+    if (e->entries[i])
+      printf("    case %d: goto L%d;\n", i, i);
+  printf("  }\n");
+  printf("  not_a_function();\n");
+  printf("dispatch:\n");
+  printf("  switch (i) {\n");
+  for (i = 0; i <= e->codesidx; ++i)
+    if (returns[i])
+      printf("    case %d: goto L%d;\n", i, i);
+  printf("  }\n");
+  printf("  printf(\"Unknown pc %%ld\\n\", i);\n");
+  printf("  exit(1);\n");
+  printf("halt:\n");
+  printf("  if (e->stackidx != 0) {\n");
+  printf("    printf(\"stack not consumed\\n\");\n");
+  printf("    exit(1);\n");
+  printf("  }\n");
+  printf("  return 0;\n");
+  printf("}\n");
+  free(returns);
+}
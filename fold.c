@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include "node.h"
+#include "state.h"
+#include "vm.h"
+#include "y.tab.h"
+
+static node* fold(state*, node*);
+
+static bool is_literal(node* n) {
+  return n != NULL && (n->type == NODE_BOOL || n->type == NODE_LONG || n->type == NODE_DOUBLE);
+}
+
+static value literal_value(node* n) {
+  value v;
+  switch (n->type) {
+    case NODE_BOOL: v = BOOL_VAL(n->bval); break;
+    case NODE_LONG: v = LONG_VAL(n->lval); break;
+    default: v = DOUBLE_VAL(n->dval); break;
+  }
+  return v;
+}
+
+// Replaces n with the literal v.
+static node* new_literal(state* s, node* n, value v) {
+  node* m;
+  switch (VAL_TYPE(v)) {
+    case VT_BOOL: m = new_bool(s, AS_BOOL(v)); break;
+    case VT_LONG: m = new_long(s, AS_LONG(v)); break;
+    default: m = new_double(s, AS_DOUBLE(v)); break;
+  }
+  m->line = n->line;
+  return m;
+}
+
+// Replaces n with +expr, which drops to expr once its type is known.
+static node* new_plus(state* s, node* n, node* expr) {
+  node* m = new_uop(s, PLUS, expr);
+  m->line = n->line;
+  return fold(s, m);
+}
+
+// The type an expression evaluates to, or -1 if it is only known at runtime.
+static int expression_type(node* n) {
+  int lhs, rhs;
+  switch (n->type) {
+    case NODE_BOOL: return VT_BOOL;
+    case NODE_LONG: return VT_LONG;
+    case NODE_DOUBLE: return VT_DOUBLE;
+    case NODE_UNARYOP:
+      if (n->op == NOT)
+        return VT_BOOL;
+      lhs = expression_type(n->expr);
+      return lhs < 0 ? -1 : lhs == VT_DOUBLE ? VT_DOUBLE : VT_LONG;
+    case NODE_BINOP:
+      lhs = expression_type(n->lhs);
+      rhs = expression_type(n->rhs);
+      switch (n->op) {
+        case OR: case AND:
+          return lhs == rhs ? lhs : -1;
+        case PLUS: case MINUS: case TIMES: case DIVIDE:
+          if (lhs == VT_DOUBLE || rhs == VT_DOUBLE)
+            return VT_DOUBLE;
+          return lhs < 0 || rhs < 0 ? -1 : VT_LONG;
+        default:
+          return VT_BOOL;
+      }
+    default:
+      return -1;
+  }
+}
+
+// Whether dropping the statements would lose a variable that codegen declares.
+static bool declares(node* n) {
+  node* m;
+  if (n == NULL)
+    return false;
+  switch (n->type) {
+    case NODE_FUNCTION:
+    case NODE_ASSIGN:
+      return true;
+    case NODE_STMTS:
+      for (m = n->stmts; m != NULL; m = m->next)
+        if (declares(m))
+          return true;
+      return false;
+    case NODE_IF:
+      return declares(n->body) || declares(n->orelse);
+    case NODE_WHILE:
+      return declares(n->body);
+    case NODE_FOR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool is_long(node* n, long l) {
+  return n->type == NODE_LONG && n->lval == l;
+}
+
+static node* fold_uop(state* s, node* n) {
+  value v; env fe; env* e = &fe;
+  n->expr = fold(s, n->expr);
+  if (n->op == PLUS) {
+    int type = expression_type(n->expr);
+    if (type == VT_LONG || type == VT_DOUBLE)
+      return n->expr;
+  }
+  if (!is_literal(n->expr))
+    return n;
+  fe.stack = &v;
+  fe.stackidx = 0;
+  e->stack[e->stackidx++] = literal_value(n->expr);
+  switch (n->op) {
+    case NOT:
+      v = BOOL_VAL(!TO_BOOL(v));
+      break;
+    case PLUS: UNARY_OP(+); break;
+    case MINUS: UNARY_OP(-); break;
+    default: return n;
+  }
+  return new_literal(s, n, v);
+}
+
+static node* fold_binop(state* s, node* n) {
+  node *lhs, *rhs;
+  value v[2]; env fe; env* e = &fe;
+  lhs = n->lhs = fold(s, n->lhs);
+  rhs = n->rhs = fold(s, n->rhs);
+  if (is_literal(lhs) && (n->op == AND || n->op == OR)) {
+    if (TO_BOOL(literal_value(lhs)) == (n->op == OR))
+      return lhs;
+    return rhs;
+  }
+  if (!is_literal(lhs) || !is_literal(rhs)) {
+    switch (n->op) {
+      case PLUS:
+        if (is_long(rhs, 0) && expression_type(lhs) != VT_DOUBLE && expression_type(lhs) >= 0)
+          return new_plus(s, n, lhs);
+        if (is_long(lhs, 0) && expression_type(rhs) != VT_DOUBLE && expression_type(rhs) >= 0)
+          return new_plus(s, n, rhs);
+        break;
+      case MINUS:
+        if (is_long(rhs, 0))
+          return new_plus(s, n, lhs);
+        break;
+      case TIMES:
+        if (is_long(rhs, 1))
+          return new_plus(s, n, lhs);
+        if (is_long(lhs, 1))
+          return new_plus(s, n, rhs);
+        break;
+      case DIVIDE:
+        if (is_long(rhs, 1))
+          return new_plus(s, n, lhs);
+        break;
+    }
+    return n;
+  }
+  fe.stack = v;
+  fe.stackidx = 0;
+  e->stack[e->stackidx++] = literal_value(lhs);
+  e->stack[e->stackidx++] = literal_value(rhs);
+  if (n->op == DIVIDE && !IS_DOUBLE(v[0]) && !IS_DOUBLE(v[1]) &&
+      (TO_LONG(v[1]) == 0 || (TO_LONG(v[1]) == -1 && TO_LONG(v[0]) == LONG_MIN)))
+    return n;
+  switch (n->op) {
+    case PLUS: BINARY_OP(+); break;
+    case MINUS: BINARY_OP(-); break;
+    case TIMES: BINARY_OP(*); break;
+    case DIVIDE: BINARY_OP(/); break;
+    case GT: LOGICAL_BINARY_OP(>); break;
+    case GE: LOGICAL_BINARY_OP(>=); break;
+    case EQEQ: LOGICAL_BINARY_OP(==); break;
+    case NEQ: LOGICAL_BINARY_OP(!=); break;
+    case LT: LOGICAL_BINARY_OP(<); break;
+    case LE: LOGICAL_BINARY_OP(<=); break;
+    default: return n;
+  }
+  return new_literal(s, n, v[0]);
+}
+
+// Folds the statements or arguments of a list, dropping those that fold away.
+static node* fold_list(state* s, node* n) {
+  node *head = NULL, **p = &head, *next, *m;
+  for (; n != NULL; n = next) {
+    next = n->next;
+    if ((m = fold(s, n)) != NULL) {
+      *p = m;
+      p = &m->next;
+    }
+  }
+  *p = NULL;
+  return head;
+}
+
+static node* fold(state* s, node* n) {
+  if (n == NULL)
+    return NULL;
+  switch (n->type) {
+    case NODE_FUNCTION:
+      n->body = fold(s, n->body);
+      break;
+    case NODE_RETURN:
+    case NODE_PRINT:
+    case NODE_ASSIGN:
+      n->expr = fold(s, n->expr);
+      break;
+    case NODE_STMTS:
+      n->stmts = fold_list(s, n->stmts);
+      break;
+    case NODE_IF:
+      n->cond = fold(s, n->cond);
+      n->body = fold(s, n->body);
+      n->orelse = fold(s, n->orelse);
+      if (is_literal(n->cond)) {
+        if (TO_BOOL(literal_value(n->cond)) && !declares(n->orelse))
+          return n->body;
+        if (!TO_BOOL(literal_value(n->cond)) && !declares(n->body))
+          return n->orelse;
+      }
+      break;
+    case NODE_WHILE:
+      n->cond = fold(s, n->cond);
+      n->body = fold(s, n->body);
+      if (is_literal(n->cond) && !TO_BOOL(literal_value(n->cond)) && !declares(n->body))
+        return NULL;
+      break;
+    case NODE_FOR:
+      n->args = fold_list(s, n->args);
+      n->body = fold(s, n->body);
+      break;
+    case NODE_FCALL:
+      n->args = fold_list(s, n->args);
+      break;
+    case NODE_UNARYOP:
+      return fold_uop(s, n);
+    case NODE_BINOP:
+      return fold_binop(s, n);
+  }
+  return n;
+}
@@ -1,3 +1,6 @@
+#include <string.h>
+#include <unistd.h>
+
 static void f_min(env* e, value* values, int len) {
   int i; long l; double d, g;
   if (len == 0) {
@@ -5,21 +8,20 @@ static void f_min(env* e, value* values, int len) {
     exit(1);
   }
   value v;
-  v.type = VT_LONG;
+  v = LONG_VAL(0);
   for (i = 0; i < len; ++i) {
-    if (v.type == VT_LONG) {
-      if (values[i].type == VT_LONG || values[i].type == VT_BOOL) {
+    if (VAL_TYPE(v) == VT_LONG) {
+      if (VAL_TYPE(values[i]) == VT_LONG || VAL_TYPE(values[i]) == VT_BOOL) {
         l = TO_LONG(values[i]);
-        v.lval = i == 0 ? l : l > v.lval ? v.lval : l;
+        v = LONG_VAL(i == 0 ? l : l > AS_LONG(v) ? AS_LONG(v) : l);
         continue;
       }
-      v.type = VT_DOUBLE;
-      d = (double)v.lval;
+      d = (double)AS_LONG(v);
     } else {
-      d = v.dval;
+      d = AS_DOUBLE(v);
     }
     g = TO_DOUBLE(values[i]);
-    v.dval = i == 0 ? g : d > g ? g : d;
+    v = DOUBLE_VAL(i == 0 ? g : d > g ? g : d);
   }
   e->stack[e->stackidx++] = v;
 }
@@ -31,21 +33,20 @@ static void f_max(env* e, value* values, int len) {
     printf("Invalid argument for max()\n");
     exit(1);
   }
-  v.type = VT_LONG;
+  v = LONG_VAL(0);
   for (i = 0; i < len; ++i) {
-    if (v.type == VT_LONG) {
-      if (values[i].type == VT_LONG || values[i].type == VT_BOOL) {
+    if (VAL_TYPE(v) == VT_LONG) {
+      if (VAL_TYPE(values[i]) == VT_LONG || VAL_TYPE(values[i]) == VT_BOOL) {
         l = TO_LONG(values[i]);
-        v.lval = i == 0 ? l : l > v.lval ? l : v.lval;
+        v = LONG_VAL(i == 0 ? l : l > AS_LONG(v) ? l : AS_LONG(v));
         continue;
       }
-      v.type = VT_DOUBLE;
-      d = (double)v.lval;
+      d = (double)AS_LONG(v);
     } else {
-      d = v.dval;
+      d = AS_DOUBLE(v);
     }
     g = TO_DOUBLE(values[i]);
-    v.dval = i == 0 ? g : d > g ? d : g;
+    v = DOUBLE_VAL(i == 0 ? g : d > g ? d : g);
   }
   e->stack[e->stackidx++] = v;
 }
@@ -57,17 +58,119 @@ static void f_abs(env* e, value* values, int len) {
     exit(1);
   }
   v = values[0];
-  if (v.type == VT_DOUBLE) {
-    e->stack[e->stackidx++].dval = v.dval >= 0.0 ? v.dval : -v.dval;
+  if (IS_DOUBLE(v)) {
+    e->stack[e->stackidx++] = DOUBLE_VAL(AS_DOUBLE(v) >= 0.0 ? AS_DOUBLE(v) : -AS_DOUBLE(v));
   } else {
     long l = TO_LONG(v);
-    e->stack[e->stackidx].type = VT_LONG;
-    e->stack[e->stackidx++].lval = l >= 0 ? l : -l;
+    e->stack[e->stackidx++] = LONG_VAL(l >= 0 ? l : -l);
+  }
+}
+
+// The numbers read() returns come from this buffered reader. The program source
+// never goes through it; without a source file or --input, fd is -1.
+typedef struct reader {
+  int fd;
+  uint32_t index;
+  uint32_t length;
+  bool eof;
+  char buffer[1 << 16];
+} reader;
+
+static reader input = { .fd = 0 };
+
+// Keeps at least n bytes after index in the buffer unless the input ends.
+static void fill_input(uint32_t n) {
+  ssize_t r;
+  if (input.length - input.index >= n || input.eof)
+    return;
+  memmove(input.buffer, input.buffer + input.index, input.length - input.index);
+  input.length -= input.index;
+  input.index = 0;
+  fflush(stdout);
+  while (input.length < n) {
+    r = input.fd < 0 ? 0 : read(input.fd, input.buffer + input.length, sizeof(input.buffer) - input.length);
+    if (r <= 0) {
+      input.eof = true;
+      return;
+    }
+    input.length += r;
+  }
+}
+
+static bool is_digit(char c) {
+  return '0' <= c && c <= '9';
+}
+
+static char input_at(uint32_t i) {
+  return input.index + i < input.length ? input.buffer[input.index + i] : 0;
+}
+
+static bool is_number_start(void) {
+  char c = input_at(0), d = input_at(1);
+  return is_digit(c) ||
+    ((c == '-' || c == '+' || c == '.') && is_digit(d)) ||
+    ((c == '-' || c == '+') && d == '.' && is_digit(input_at(2)));
+}
+
+// Skips up to the next number and reports whether there is one.
+static bool skip_input(void) {
+  for (;;) {
+    fill_input(64);
+    if (input.index == input.length)
+      return false;
+    if (is_number_start())
+      return true;
+    input.index++;
+  }
+}
+
+static void f_read(env* e, value* values, int len) {
+  if (len != 0) {
+    printf("Invalid argument for read()\n");
+    exit(1);
+  }
+  if (!skip_input()) {
+    e->stack[e->stackidx++] = BOOL_VAL(false);
+    return;
+  }
+  char* p = input.buffer + input.index, *end = input.buffer + input.length;
+  char* q = p + (*p == '-' || *p == '+');
+  unsigned long l = 0;
+  int digits = 0;
+  for (; q < end && '0' <= *q && *q <= '9'; ++q, ++digits)
+    l = l * 10 + (*q - '0');
+  if ((q < end && (*q == '.' || *q == 'e' || *q == 'E')) || digits > 18) {
+    char buf[64];
+    int n = end - p < (long)sizeof(buf) - 1 ? end - p : (long)sizeof(buf) - 1;
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    double d = strtod(buf, &q);
+    if (q == buf) {
+      // Not a number after all, so it is skipped like any other byte.
+      input.index++;
+      f_read(e, values, len);
+      return;
+    }
+    input.index += q - buf;
+    e->stack[e->stackidx++] = DOUBLE_VAL(d);
+    return;
+  }
+  input.index += q - p;
+  e->stack[e->stackidx++] = LONG_VAL(*p == '-' ? -(long)l : (long)l);
+}
+
+static void f_eof(env* e, value* values, int len) {
+  if (len != 0) {
+    printf("Invalid argument for eof()\n");
+    exit(1);
   }
+  e->stack[e->stackidx++] = BOOL_VAL(!skip_input());
 }
 
 func gfuncs[] = {
   { "abs", f_abs },
   { "min", f_min },
   { "max", f_max },
+  { "read", f_read },
+  { "eof", f_eof },
 };
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "node.h"
+#include "vm.h"
+#include "y.tab.h"
+
+static int join_type(int t, int u) {
+  if (t == VT_UNSET)
+    return u;
+  if (u == VT_UNSET)
+    return t;
+  return t == u ? t : VT_UNKNOWN;
+}
+
+// Only the first TYPED_VARIABLES slots are tracked, the rest stay untyped.
+static int8_t* variable_type(env* e, variable_index vi) {
+  if (vi.index >= TYPED_VARIABLES)
+    return NULL;
+  return vi.global ? &e->variable_types[vi.index] : &e->local_variable_types[vi.index];
+}
+
+// The type an expression evaluates to under the current variable types.
+static int infer_type(env* e, node* n) {
+  int lhs, rhs;
+  variable_index vi;
+  switch (n->type) {
+    case NODE_BOOL: return VT_BOOL;
+    case NODE_LONG: return VT_LONG;
+    case NODE_DOUBLE: return VT_DOUBLE;
+    case NODE_IDENTIFIER:
+      vi = lookup(e, n->name, false);
+      return vi.index < 0 || vi.index >= TYPED_VARIABLES ? VT_UNKNOWN : *variable_type(e, vi);
+    case NODE_UNARYOP:
+      if (n->op == NOT)
+        return VT_BOOL;
+      lhs = infer_type(e, n->expr);
+      return lhs < 0 ? lhs : lhs == VT_DOUBLE ? VT_DOUBLE : VT_LONG;
+    case NODE_BINOP:
+      lhs = infer_type(e, n->lhs);
+      rhs = infer_type(e, n->rhs);
+      switch (n->op) {
+        case OR: case AND:
+          return join_type(lhs, rhs);
+        case PLUS: case MINUS: case TIMES: case DIVIDE:
+          if (lhs == VT_DOUBLE || rhs == VT_DOUBLE)
+            return VT_DOUBLE;
+          if (lhs == VT_UNKNOWN || rhs == VT_UNKNOWN)
+            return VT_UNKNOWN;
+          return lhs == VT_UNSET || rhs == VT_UNSET ? VT_UNSET : VT_LONG;
+        default:
+          return VT_BOOL;
+      }
+    default:
+      return VT_UNKNOWN;
+  }
+}
+
+static bool update_type(env* e, variable_index vi, int type) {
+  int8_t* t = variable_type(e, vi);
+  if (t == NULL)
+    return false;
+  type = join_type(*t, type);
+  if (*t == type)
+    return false;
+  *t = type;
+  return true;
+}
+
+static int8_t* new_function_types(env* e) {
+  int i;
+  if (e->functionsidx == e->functionslen) {
+    e->functionslen = e->functionslen ? e->functionslen * 2 : 16;
+    e->function_types = realloc(e->function_types, e->functionslen * sizeof(int8_t*));
+    for (i = e->functionsidx; i < e->functionslen; ++i)
+      e->function_types[i] = NULL;
+  }
+  if (e->function_types[e->functionsidx] == NULL) {
+    e->function_types[e->functionsidx] = malloc(TYPED_VARIABLES);
+    memset(e->function_types[e->functionsidx], VT_UNSET, TYPED_VARIABLES);
+  }
+  return e->function_types[e->functionsidx++];
+}
+
+typedef struct assigned {
+  bool global[TYPED_VARIABLES];
+  bool local[TYPED_VARIABLES];
+  bool untracked;
+} assigned;
+
+static bool* is_assigned(assigned* a, variable_index vi) {
+  if (vi.index >= TYPED_VARIABLES) {
+    a->untracked = false;
+    return &a->untracked;
+  }
+  return vi.global ? &a->global[vi.index] : &a->local[vi.index];
+}
+
+static void intersect_assigned(assigned* a, assigned* b) {
+  int i;
+  for (i = 0; i < TYPED_VARIABLES; ++i) {
+    a->global[i] = a->global[i] && b->global[i];
+    a->local[i] = a->local[i] && b->local[i];
+  }
+}
+
+// A read of a variable that is not definitely assigned may see the initial
+// false, so the variable loses its type.
+static bool infer_reads(env* e, node* n, assigned* a) {
+  bool changed = false;
+  node* m;
+  variable_index vi;
+  switch (n->type) {
+    case NODE_IDENTIFIER:
+      vi = lookup(e, n->name, false);
+      if (vi.index >= 0 && !*is_assigned(a, vi))
+        changed = update_type(e, vi, VT_UNKNOWN);
+      break;
+    case NODE_FCALL:
+      for (m = n->args; m != NULL; m = m->next)
+        changed = infer_reads(e, m, a) || changed;
+      break;
+    case NODE_UNARYOP:
+      changed = infer_reads(e, n->expr, a);
+      break;
+    case NODE_BINOP:
+      changed = infer_reads(e, n->lhs, a);
+      changed = infer_reads(e, n->rhs, a) || changed;
+      break;
+  }
+  return changed;
+}
+
+static bool infer_args(env* e, node* params, assigned* a) {
+  bool changed = false;
+  variable_index vi;
+  for (; params != NULL; params = params->next) {
+    vi = lookup(e, params->name, true);
+    *is_assigned(a, vi) = true;
+    changed = update_type(e, vi, VT_UNKNOWN) || changed;
+  }
+  return changed;
+}
+
+static bool infer_stmt(env* e, node* n, assigned* a) {
+  bool changed = false;
+  node* m;
+  variable_index vi;
+  assigned b;
+  switch (n->type) {
+    case NODE_FUNCTION:
+      vi = lookup(e, n->name, true);
+      *is_assigned(a, vi) = true;
+      changed = update_type(e, vi, VT_UNKNOWN);
+      new_local_variables(e);
+      e->local_variable_types = new_function_types(e);
+      b = *a;
+      memset(b.local, 0, sizeof(b.local));
+      changed = infer_args(e, n->params, &b) || changed;
+      changed = infer_stmt(e, n->body, &b) || changed;
+      free(e->local_variables);
+      e->local_variables = NULL;
+      e->local_variables_len = 0;
+      e->local_variable_types = NULL;
+      break;
+    case NODE_RETURN:
+    case NODE_PRINT:
+      changed = infer_reads(e, n->expr, a);
+      break;
+    case NODE_STMTS:
+      for (m = n->stmts; m != NULL; m = m->next)
+        changed = infer_stmt(e, m, a) || changed;
+      break;
+    case NODE_ASSIGN:
+      vi = lookup(e, n->name, true);
+      changed = infer_reads(e, n->expr, a);
+      changed = update_type(e, vi, infer_type(e, n->expr)) || changed;
+      *is_assigned(a, vi) = true;
+      break;
+    case NODE_IF:
+      changed = infer_reads(e, n->cond, a);
+      b = *a;
+      changed = infer_stmt(e, n->body, &b) || changed;
+      if (n->orelse != NULL)
+        changed = infer_stmt(e, n->orelse, a) || changed;
+      intersect_assigned(a, &b);
+      break;
+    case NODE_WHILE:
+      changed = infer_reads(e, n->cond, a);
+      b = *a;
+      changed = infer_stmt(e, n->body, &b) || changed;
+      break;
+    case NODE_FOR: {
+      // The counter starts as the start value and is then stepped by adding.
+      int start = infer_type(e, n->args), step = VT_LONG;
+      vi = lookup(e, n->name, true);
+      for (m = n->args; m != NULL; m = m->next)
+        changed = infer_reads(e, m, a) || changed;
+      if (n->args->next->next != NULL)
+        step = infer_type(e, n->args->next->next);
+      changed = update_type(e, vi, start) || changed;
+      if (start == VT_DOUBLE || step == VT_DOUBLE)
+        step = VT_DOUBLE;
+      else if (start < 0 || step < 0)
+        step = start == VT_UNKNOWN || step == VT_UNKNOWN ? VT_UNKNOWN : VT_UNSET;
+      else
+        step = VT_LONG;
+      changed = update_type(e, vi, step) || changed;
+      *is_assigned(a, vi) = true;
+      b = *a;
+      changed = infer_stmt(e, n->body, &b) || changed;
+      break;
+    }
+  }
+  return changed;
+}
+
+static void clear_variable_names(env* e) {
+  int i;
+  for (i = 0; i < e->variableslen; ++i)
+    e->variables[i].name = NULL;
+  e->variableslen = 0;
+  clear_variable_map(&e->variable_map);
+  e->functionsidx = 0;
+}
+
+// Assigns a type to every variable slot by iterating to a fixed point. Slots
+// that are never assigned a known type end up as VT_UNKNOWN. Runs again after
+// optimize_loops has added temporaries, so it starts over from VT_UNSET.
+static void infer(env* e, node* n) {
+  int i, j;
+  assigned a;
+  memset(e->variable_types, VT_UNSET, TYPED_VARIABLES);
+  for (i = 0; i < e->functionslen && e->function_types[i] != NULL; ++i)
+    memset(e->function_types[i], VT_UNSET, TYPED_VARIABLES);
+  do {
+    clear_variable_names(e);
+    memset(&a, 0, sizeof(a));
+  } while (infer_stmt(e, n, &a));
+  clear_variable_names(e);
+  for (i = 0; i < TYPED_VARIABLES; ++i)
+    if (e->variable_types[i] == VT_UNSET)
+      e->variable_types[i] = VT_UNKNOWN;
+  for (i = 0; i < e->functionslen && e->function_types[i] != NULL; ++i)
+    for (j = 0; j < TYPED_VARIABLES; ++j)
+      if (e->function_types[i][j] == VT_UNSET)
+        e->function_types[i][j] = VT_UNKNOWN;
+}
@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "opcode.h"
+#include "vm.h"
+
+#if defined(__x86_64__) && !defined(NANBOX)
+
+#include <sys/mman.h>
+
+/*
+ * A template JIT translating the whole program into x86-64 code. The VM stack
+ * and variables stay in memory with the interpreter's layout; the native code
+ * keeps the stack top in rbx, the variables in r12, the current frame
+ * (&variables[base]) in r13, the env in r14 and the pc to native address
+ * table in r15. Long arithmetic and comparisons have inline fast paths; other
+ * operands and other instructions call back into C.
+ */
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define R12 12
+#define R13 13
+#define R14 14
+
+#define VALUE_SIZE          ((int)sizeof(value))
+#define VARIABLE_SIZE       ((int)sizeof(variable))
+#define GLOBAL_DISP(a)      ((a) * VARIABLE_SIZE + (int)offsetof(variable, value))
+#define LOCAL_DISP(a)       ((a) * VARIABLE_SIZE + (int)offsetof(variable, value))
+#define PAYLOAD             ((int)offsetof(value, lval))
+
+typedef struct jit_fixup {
+  uint32_t pos;
+  uint32_t pc;
+} jit_fixup;
+
+typedef struct jit_code {
+  uint8_t* code;
+  uint32_t codeidx;
+  uint32_t codelen;
+  uint32_t* addrs;
+  jit_fixup* fixups;
+  uint32_t fixupsidx;
+  uint32_t fixupslen;
+} jit_code;
+
+static void emit(jit_code* j, int n, ...) {
+  va_list ap;
+  va_start(ap, n);
+  if (j->codeidx + n > j->codelen) {
+    j->codelen *= 2;
+    j->code = realloc(j->code, j->codelen);
+  }
+  while (n--)
+    j->code[j->codeidx++] = (uint8_t)va_arg(ap, int);
+  va_end(ap);
+}
+
+static void emit32(jit_code* j, int32_t x) {
+  emit(j, 4, x & 0xff, (x >> 8) & 0xff, (x >> 16) & 0xff, (x >> 24) & 0xff);
+}
+
+static void emit64(jit_code* j, int64_t x) {
+  emit32(j, (int32_t)x);
+  emit32(j, (int32_t)(x >> 32));
+}
+
+// op reg, [base + disp32] with an optional REX.W
+static void emit_mem(jit_code* j, bool w, int op, int reg, int base, int32_t disp) {
+  int rex = (w ? 8 : 0) | (reg >> 3) << 2 | base >> 3;
+  if (rex)
+    emit(j, 1, 0x40 | rex);
+  if (op > 0xff)
+    emit(j, 1, op >> 8);
+  emit(j, 1, op & 0xff);
+  emit(j, 1, 0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == 4)
+    emit(j, 1, 0x24);
+  emit32(j, disp);
+}
+
+static void emit_lea_rbx(jit_code* j, int32_t disp) {
+  emit_mem(j, true, 0x8d, RBX, RBX, disp);
+}
+
+// movdqu xmm0, [src]; movdqu [dst], xmm0
+static void emit_copy(jit_code* j, int src, int32_t src_disp, int dst, int32_t dst_disp) {
+  emit(j, 1, 0xf3);
+  emit_mem(j, false, 0x0f6f, 0, src, src_disp);
+  emit(j, 1, 0xf3);
+  emit_mem(j, false, 0x0f7f, 0, dst, dst_disp);
+}
+
+static void emit_store_long(jit_code* j, int type, int64_t l) {
+  emit_mem(j, false, 0xc7, 0, RBX, 0); emit32(j, type);
+  emit(j, 2, 0x48, 0xb8); emit64(j, l);
+  emit_mem(j, true, 0x89, RAX, RBX, PAYLOAD);
+  emit_lea_rbx(j, VALUE_SIZE);
+}
+
+// cmp dword [base + disp], type; jne label
+static uint32_t emit_check_type(jit_code* j, int base, int32_t disp, int type) {
+  emit_mem(j, false, 0x83, 7, base, disp); emit(j, 1, type);
+  emit(j, 2, 0x0f, 0x85); emit32(j, 0);
+  return j->codeidx - 4;
+}
+
+static uint32_t emit_jcc(jit_code* j, int cc) {
+  emit(j, 2, 0x0f, cc); emit32(j, 0);
+  return j->codeidx - 4;
+}
+
+static uint32_t emit_jmp(jit_code* j) {
+  emit(j, 1, 0xe9); emit32(j, 0);
+  return j->codeidx - 4;
+}
+
+static void bind(jit_code* j, uint32_t pos) {
+  int32_t rel = j->codeidx - (pos + 4);
+  memcpy(j->code + pos, &rel, 4);
+}
+
+static void jump_to(jit_code* j, uint32_t pos, uint32_t pc) {
+  if (j->fixupsidx == j->fixupslen) {
+    j->fixupslen *= 2;
+    j->fixups = realloc(j->fixups, j->fixupslen * sizeof(jit_fixup));
+  }
+  j->fixups[j->fixupsidx].pos = pos;
+  j->fixups[j->fixupsidx++].pc = pc;
+}
+
+static void emit_call(jit_code* j, void* f, int pc) {
+  emit(j, 3, 0x4c, 0x89, 0xf7);              // mov rdi, r14
+  emit(j, 1, 0xbe); emit32(j, pc);           // mov esi, pc
+  emit(j, 3, 0x48, 0x89, 0xda);              // mov rdx, rbx
+  emit(j, 3, 0x4c, 0x89, 0xe9);              // mov rcx, r13
+  emit(j, 2, 0x48, 0xb8); emit64(j, (int64_t)(intptr_t)f);
+  emit(j, 2, 0xff, 0xd0);                    // call rax
+}
+
+typedef struct jit_target {
+  variable* frame;
+  long pc;
+} jit_target;
+
+// Calls, returns and frame entries update the frame stack in C. The variables
+// may move when a frame grows them, so the native code reloads its registers.
+static jit_target jit_frame(env* e, int i, value* sp, variable* frame) {
+  jit_target t;
+  e->stackidx = sp - e->stack;
+  switch (GET_OPCODE(e->codes[i])) {
+    case OP_CALL:
+      t.pc = function_entry(e, e->variables[GET_ARG_A(e->codes[i])].value);
+      call_frame(e, i, GET_ARG_B(e->codes[i]));
+      break;
+    case OP_TAILCALL:
+      t.pc = function_entry(e, e->variables[GET_ARG_A(e->codes[i])].value);
+      tail_call_frame(e, GET_ARG_B(e->codes[i]));
+      break;
+    case OP_ENTER:
+      enter_frame(e, GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i]));
+      t.pc = i + 1;
+      break;
+    default:
+      t.pc = e->frames[--e->framesidx].pc + 1;
+      break;
+  }
+  t.frame = e->variables + e->frames[e->framesidx - 1].base;
+  return t;
+}
+
+static void emit_frame(jit_code* j, int pc, bool jump) {
+  emit_call(j, (void*)jit_frame, pc);
+  emit(j, 3, 0x49, 0x89, 0xc5);              // mov r13, rax
+  emit_mem(j, true, 0x8b, R12, R14, offsetof(env, variables));
+  if (jump) {
+    emit_mem(j, true, 0x8b, RBX, R14, offsetof(env, stack));
+    emit_mem(j, false, 0x8b, RAX, R14, offsetof(env, stackidx));
+    emit(j, 4, 0x48, 0xc1, 0xe0, 0x04);      // shl rax, 4
+    emit(j, 3, 0x48, 0x01, 0xc3);            // add rbx, rax
+    emit(j, 4, 0x41, 0xff, 0x24, 0xd7);      // jmp [r15 + rdx * 8]
+  }
+}
+
+static value* jit_step(env* e, int i, value* sp, variable* frame) {
+  int base = frame - e->variables;
+  e->stackidx = sp - e->stack;
+  switch (GET_OPCODE(e->codes[i])) {
+    case OP_PRINT: print_value(e->stack[--e->stackidx]); break;
+    case OP_FCALL: {
+      int len = GET_ARG_B(e->codes[i]);
+      gfuncs[GET_ARG_A(e->codes[i])].func(e, &e->stack[e->stackidx -= len], len);
+      break;
+    }
+    case OP_UNOT: {
+      bool b = !TO_BOOL(e->stack[e->stackidx - 1]);
+      e->stack[e->stackidx - 1] = BOOL_VAL(b);
+      break;
+    }
+    case OP_UADD: UNARY_OP(+); break;
+    case OP_UMINUS: UNARY_OP(-); break;
+    case OP_ADD: case OP_ADD_LL: case OP_ADD_DD: case OP_ADD_LONG: case OP_ADD_DOUBLE:
+      BINARY_OP(+); break;
+    case OP_MINUS: case OP_MINUS_LL: case OP_MINUS_DD: case OP_MINUS_LONG: case OP_MINUS_DOUBLE:
+      BINARY_OP(-); break;
+    case OP_TIMES: case OP_TIMES_LL: case OP_TIMES_DD: case OP_TIMES_LONG: case OP_TIMES_DOUBLE:
+      BINARY_OP(*); break;
+    case OP_DIVIDE: case OP_DIVIDE_LL: case OP_DIVIDE_DD: case OP_DIVIDE_LONG: case OP_DIVIDE_DOUBLE:
+      BINARY_OP(/); break;
+    case OP_GT: case OP_GT_LL: case OP_GT_DD: case OP_GT_LONG: case OP_GT_DOUBLE:
+      LOGICAL_BINARY_OP(>); break;
+    case OP_GE: case OP_GE_LL: case OP_GE_DD: case OP_GE_LONG: case OP_GE_DOUBLE:
+      LOGICAL_BINARY_OP(>=); break;
+    case OP_EQEQ: case OP_EQEQ_LL: case OP_EQEQ_DD: case OP_EQEQ_LONG: case OP_EQEQ_DOUBLE:
+      LOGICAL_BINARY_OP(==); break;
+    case OP_NEQ: case OP_NEQ_LL: case OP_NEQ_DD: case OP_NEQ_LONG: case OP_NEQ_DOUBLE:
+      LOGICAL_BINARY_OP(!=); break;
+    case OP_LT: case OP_LT_LL: case OP_LT_DD: case OP_LT_LONG: case OP_LT_DOUBLE:
+      LOGICAL_BINARY_OP(<); break;
+    case OP_LE: case OP_LE_LL: case OP_LE_DD: case OP_LE_LONG: case OP_LE_DOUBLE:
+      LOGICAL_BINARY_OP(<=); break;
+    case OP_IADD: case OP_IADD_LONG: IBINARY_OP(+, GET_ARG_A(e->codes[i])); break;
+    case OP_IMINUS: case OP_IMINUS_LONG: IBINARY_OP(-, GET_ARG_A(e->codes[i])); break;
+    case OP_IGT: case OP_IGT_LONG: ILOGICAL_BINARY_OP(>, GET_ARG_A(e->codes[i])); break;
+    case OP_IGE: case OP_IGE_LONG: ILOGICAL_BINARY_OP(>=, GET_ARG_A(e->codes[i])); break;
+    case OP_IEQEQ: case OP_IEQEQ_LONG: ILOGICAL_BINARY_OP(==, GET_ARG_A(e->codes[i])); break;
+    case OP_INEQ: case OP_INEQ_LONG: ILOGICAL_BINARY_OP(!=, GET_ARG_A(e->codes[i])); break;
+    case OP_ILT: case OP_ILT_LONG: ILOGICAL_BINARY_OP(<, GET_ARG_A(e->codes[i])); break;
+    case OP_ILE: case OP_ILE_LONG: ILOGICAL_BINARY_OP(<=, GET_ARG_A(e->codes[i])); break;
+    case OP_INC: case OP_INC_LONG:
+      INC_OP(e->variables[GET_ARG_A(e->codes[i])].value, GET_ARG_B(e->codes[i])); break;
+    case OP_INC_LOCAL: case OP_INC_LOCAL_LONG:
+      INC_OP(e->variables[base + GET_ARG_A(e->codes[i])].value, GET_ARG_B(e->codes[i])); break;
+    default: printf("Unknown opcode %d\n", GET_OPCODE(e->codes[i])); exit(1);
+  }
+  return e->stack + e->stackidx;
+}
+
+// Pops the operands of a conditional jump and returns whether it is taken.
+static bool jit_branch(env* e, int i, value* sp, variable* frame) {
+  int pc = i;
+  e->stackidx = sp - e->stack;
+  switch (GET_OPCODE(e->codes[i])) {
+    case OP_FORPREP: return !for_prep(e->variables[GET_ARG_B(e->codes[i])].value, sp[-2], sp[-1]);
+    case OP_FORPREP_LOCAL: return !for_prep(frame[GET_ARG_B(e->codes[i])].value, sp[-2], sp[-1]);
+    case OP_FORLOOP: return for_loop(&e->variables[GET_ARG_B(e->codes[i])].value, sp[-2], sp[-1]);
+    case OP_FORLOOP_LOCAL: return for_loop(&frame[GET_ARG_B(e->codes[i])].value, sp[-2], sp[-1]);
+    case OP_JMP_IF: return evaluate_bool(e);
+    case OP_JMP_IFNOT: return !evaluate_bool(e);
+    case OP_JMP_IFNOT_GT: case OP_JMP_IFNOT_GT_LL: case OP_JMP_IFNOT_GT_DD:
+    case OP_JMP_IFNOT_GT_LONG: case OP_JMP_IFNOT_GT_DOUBLE:
+      JMP_IFNOT_BINARY_OP(>, i += GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_GE: case OP_JMP_IFNOT_GE_LL: case OP_JMP_IFNOT_GE_DD:
+    case OP_JMP_IFNOT_GE_LONG: case OP_JMP_IFNOT_GE_DOUBLE:
+      JMP_IFNOT_BINARY_OP(>=, i += GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_EQEQ: case OP_JMP_IFNOT_EQEQ_LL: case OP_JMP_IFNOT_EQEQ_DD:
+    case OP_JMP_IFNOT_EQEQ_LONG: case OP_JMP_IFNOT_EQEQ_DOUBLE:
+      JMP_IFNOT_BINARY_OP(==, i += GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_NEQ: case OP_JMP_IFNOT_NEQ_LL: case OP_JMP_IFNOT_NEQ_DD:
+    case OP_JMP_IFNOT_NEQ_LONG: case OP_JMP_IFNOT_NEQ_DOUBLE:
+      JMP_IFNOT_BINARY_OP(!=, i += GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LT: case OP_JMP_IFNOT_LT_LL: case OP_JMP_IFNOT_LT_DD:
+    case OP_JMP_IFNOT_LT_LONG: case OP_JMP_IFNOT_LT_DOUBLE:
+      JMP_IFNOT_BINARY_OP(<, i += GET_ARG_A(e->codes[i])); break;
+    case OP_JMP_IFNOT_LE: case OP_JMP_IFNOT_LE_LL: case OP_JMP_IFNOT_LE_DD:
+    case OP_JMP_IFNOT_LE_LONG: case OP_JMP_IFNOT_LE_DOUBLE:
+      JMP_IFNOT_BINARY_OP(<=, i += GET_ARG_A(e->codes[i])); break;
+  }
+  return i != pc;
+}
+
+static void emit_slow_step(jit_code* j, int i, uint32_t* slow, int n) {
+  jump_to(j, emit_jmp(j), i + 1);
+  while (n--)
+    bind(j, slow[n]);
+  emit_call(j, (void*)jit_step, i);
+  emit(j, 3, 0x48, 0x89, 0xc3);              // mov rbx, rax
+}
+
+static void emit_branch(jit_code* j, int i, int target, int pop) {
+  emit_call(j, (void*)jit_branch, i);
+  emit_lea_rbx(j, -pop * VALUE_SIZE);
+  emit(j, 2, 0x84, 0xc0);                    // test al, al
+  jump_to(j, emit_jcc(j, 0x85), target);
+}
+
+static void emit_slow_branch(jit_code* j, int i, uint32_t* slow, int n, int target, int pop) {
+  jump_to(j, emit_jmp(j), i + 1);
+  while (n--)
+    bind(j, slow[n]);
+  emit_branch(j, i, target, pop);
+}
+
+// op (add 0x03, sub 0x2b, imul 0x0faf) on the two longs at the top of the stack
+static void emit_binary(jit_code* j, int i, bool checked, int op) {
+  uint32_t slow[2];
+  if (checked) {
+    slow[0] = emit_check_type(j, RBX, -2 * VALUE_SIZE, VT_LONG);
+    slow[1] = emit_check_type(j, RBX, -VALUE_SIZE, VT_LONG);
+  }
+  emit_mem(j, true, 0x8b, RAX, RBX, -2 * VALUE_SIZE + PAYLOAD);
+  emit_mem(j, true, op, RAX, RBX, -VALUE_SIZE + PAYLOAD);
+  emit_mem(j, true, 0x89, RAX, RBX, -2 * VALUE_SIZE + PAYLOAD);
+  emit_lea_rbx(j, -VALUE_SIZE);
+  if (checked)
+    emit_slow_step(j, i, slow, 2);
+}
+
+// Compares the two longs at the top of the stack and sets the flags.
+static void emit_compare_longs(jit_code* j) {
+  emit_mem(j, true, 0x8b, RAX, RBX, -2 * VALUE_SIZE + PAYLOAD);
+  emit_mem(j, true, 0x3b, RAX, RBX, -VALUE_SIZE + PAYLOAD);
+}
+
+// Replaces the value at disp by a bool holding condition cc.
+static void emit_store_condition(jit_code* j, int cc, int32_t disp) {
+  emit(j, 3, 0x0f, 0x90 | cc, 0xc0);         // setcc al
+  emit(j, 3, 0x0f, 0xb6, 0xc0);              // movzx eax, al
+  emit_mem(j, true, 0x89, RAX, RBX, disp + PAYLOAD);
+  emit_mem(j, false, 0xc7, 0, RBX, disp); emit32(j, VT_BOOL);
+}
+
+static void emit_compare(jit_code* j, int i, bool checked, int cc) {
+  uint32_t slow[2];
+  if (checked) {
+    slow[0] = emit_check_type(j, RBX, -2 * VALUE_SIZE, VT_LONG);
+    slow[1] = emit_check_type(j, RBX, -VALUE_SIZE, VT_LONG);
+  }
+  emit_compare_longs(j);
+  emit_store_condition(j, cc, -2 * VALUE_SIZE);
+  emit_lea_rbx(j, -VALUE_SIZE);
+  if (checked)
+    emit_slow_step(j, i, slow, 2);
+}
+
+// op qword [top], imm with ext the /digit of add (0) or sub (5)
+static void emit_ibinary(jit_code* j, env* e, int i, bool checked, int ext) {
+  uint32_t slow;
+  if (checked)
+    slow = emit_check_type(j, RBX, -VALUE_SIZE, VT_LONG);
+  emit_mem(j, true, 0x81, ext, RBX, -VALUE_SIZE + PAYLOAD); emit32(j, GET_ARG_A(e->codes[i]));
+  if (checked)
+    emit_slow_step(j, i, &slow, 1);
+}
+
+static void emit_icompare(jit_code* j, env* e, int i, bool checked, int cc) {
+  uint32_t slow;
+  if (checked)
+    slow = emit_check_type(j, RBX, -VALUE_SIZE, VT_LONG);
+  emit_mem(j, true, 0x81, 7, RBX, -VALUE_SIZE + PAYLOAD); emit32(j, GET_ARG_A(e->codes[i]));
+  emit_store_condition(j, cc, -VALUE_SIZE);
+  if (checked)
+    emit_slow_step(j, i, &slow, 1);
+}
+
+static void emit_inc(jit_code* j, env* e, int i, bool checked, int base, int32_t disp) {
+  uint32_t slow;
+  if (checked)
+    slow = emit_check_type(j, base, disp, VT_LONG);
+  emit_mem(j, true, 0x81, 0, base, disp + PAYLOAD); emit32(j, GET_ARG_B(e->codes[i]));
+  if (checked)
+    emit_slow_step(j, i, &slow, 1);
+}
+
+static void emit_jmp_ifnot_compare(jit_code* j, env* e, int i, bool checked, int cc) {
+  uint32_t slow[2];
+  int target = i + GET_ARG_A(e->codes[i]) + 1;
+  if (checked) {
+    slow[0] = emit_check_type(j, RBX, -2 * VALUE_SIZE, VT_LONG);
+    slow[1] = emit_check_type(j, RBX, -VALUE_SIZE, VT_LONG);
+  }
+  emit_compare_longs(j);
+  emit_lea_rbx(j, -2 * VALUE_SIZE);
+  jump_to(j, emit_jcc(j, 0x80 | (cc ^ 1)), target);
+  if (checked)
+    emit_slow_branch(j, i, slow, 2, target, 2);
+}
+
+static void emit_jmp_if(jit_code* j, env* e, int i, bool b) {
+  uint32_t slow;
+  int target = i + GET_ARG_A(e->codes[i]) + 1;
+  slow = emit_check_type(j, RBX, -VALUE_SIZE, VT_BOOL);
+  emit_mem(j, false, 0x80, 7, RBX, -VALUE_SIZE + PAYLOAD); emit(j, 1, 0);
+  emit_lea_rbx(j, -VALUE_SIZE);
+  jump_to(j, emit_jcc(j, b ? 0x85 : 0x84), target);
+  jump_to(j, emit_jmp(j), i + 1);
+  bind(j, slow);
+  slow = emit_check_type(j, RBX, -VALUE_SIZE, VT_LONG);
+  emit_mem(j, true, 0x81, 7, RBX, -VALUE_SIZE + PAYLOAD); emit32(j, 0);
+  emit_lea_rbx(j, -VALUE_SIZE);
+  jump_to(j, emit_jcc(j, b ? 0x85 : 0x84), target);
+  emit_slow_branch(j, i, &slow, 1, target, 1);
+}
+
+#define CC_GT 0xf
+#define CC_GE 0xd
+#define CC_EQ 0x4
+#define CC_NE 0x5
+#define CC_LT 0xc
+#define CC_LE 0xe
+
+// Steps a long counter at [base + disp] by the step at the top of the stack and
+// jumps back while it is within the limit below it. Other types and overflow
+// take the slow path.
+static void emit_forloop(jit_code* j, env* e, int i, int base, int32_t disp) {
+  uint32_t slow[4], down;
+  int target = i + GET_ARG_A(e->codes[i]) + 1;
+  slow[0] = emit_check_type(j, base, disp, VT_LONG);
+  slow[1] = emit_check_type(j, RBX, -2 * VALUE_SIZE, VT_LONG);
+  slow[2] = emit_check_type(j, RBX, -VALUE_SIZE, VT_LONG);
+  emit_mem(j, true, 0x8b, RAX, base, disp + PAYLOAD);
+  emit_mem(j, true, 0x03, RAX, RBX, -VALUE_SIZE + PAYLOAD);
+  slow[3] = emit_jcc(j, 0x80);               // jo
+  emit_mem(j, true, 0x89, RAX, base, disp + PAYLOAD);
+  emit_mem(j, true, 0x81, 7, RBX, -VALUE_SIZE + PAYLOAD); emit32(j, 0);
+  down = emit_jcc(j, 0x80 | CC_LT);
+  emit_mem(j, true, 0x3b, RAX, RBX, -2 * VALUE_SIZE + PAYLOAD);
+  jump_to(j, emit_jcc(j, 0x80 | CC_LE), target);
+  jump_to(j, emit_jmp(j), i + 1);
+  bind(j, down);
+  emit_mem(j, true, 0x3b, RAX, RBX, -2 * VALUE_SIZE + PAYLOAD);
+  jump_to(j, emit_jcc(j, 0x80 | CC_GE), target);
+  emit_slow_branch(j, i, slow, 4, target, 0);
+}
+
+#define JIT_BINARY(op, f, arg) \
+  case OP_##op: case OP_##op##_LL: f(j, i, true, arg); break; \
+  case OP_##op##_LONG: f(j, i, false, arg); break;
+#define JIT_IMMEDIATE(op, f, arg) \
+  case OP_##op: f(j, e, i, true, arg); break; \
+  case OP_##op##_LONG: f(j, e, i, false, arg); break;
+#define JIT_JMP_IFNOT(op, cc) \
+  case OP_JMP_IFNOT_##op: case OP_JMP_IFNOT_##op##_LL: emit_jmp_ifnot_compare(j, e, i, true, cc); break; \
+  case OP_JMP_IFNOT_##op##_LONG: emit_jmp_ifnot_compare(j, e, i, false, cc); break; \
+  case OP_JMP_IFNOT_##op##_DD: case OP_JMP_IFNOT_##op##_DOUBLE: emit_branch(j, i, i + a + 1, 2); break;
+
+static void jit_instruction(jit_code* j, env* e, int i) {
+  int a = GET_ARG_A(e->codes[i]);
+  switch (GET_OPCODE(e->codes[i])) {
+    case OP_POP:
+      emit_lea_rbx(j, -VALUE_SIZE);
+      break;
+    case OP_DUP:
+      emit_copy(j, RBX, -VALUE_SIZE, RBX, 0);
+      emit_lea_rbx(j, VALUE_SIZE);
+      break;
+    case OP_LET:
+      emit_copy(j, RBX, -VALUE_SIZE, R12, GLOBAL_DISP(a));
+      emit_lea_rbx(j, -VALUE_SIZE);
+      break;
+    case OP_LET_LOCAL:
+      emit_copy(j, RBX, -VALUE_SIZE, R13, LOCAL_DISP(a));
+      emit_lea_rbx(j, -VALUE_SIZE);
+      break;
+    case OP_JMP:
+      jump_to(j, emit_jmp(j), i + a + 1);
+      break;
+    case OP_JMP_IF: emit_jmp_if(j, e, i, true); break;
+    case OP_JMP_IFNOT: emit_jmp_if(j, e, i, false); break;
+    JIT_JMP_IFNOT(GT, CC_GT)
+    JIT_JMP_IFNOT(GE, CC_GE)
+    JIT_JMP_IFNOT(EQEQ, CC_EQ)
+    JIT_JMP_IFNOT(NEQ, CC_NE)
+    JIT_JMP_IFNOT(LT, CC_LT)
+    JIT_JMP_IFNOT(LE, CC_LE)
+    case OP_FORPREP: case OP_FORPREP_LOCAL: emit_branch(j, i, i + a + 1, 0); break;
+    case OP_FORLOOP: emit_forloop(j, e, i, R12, GLOBAL_DISP(GET_ARG_B(e->codes[i]))); break;
+    case OP_FORLOOP_LOCAL: emit_forloop(j, e, i, R13, LOCAL_DISP(GET_ARG_B(e->codes[i]))); break;
+    case OP_CALL: case OP_TAILCALL: case OP_RETURN: emit_frame(j, i, true); break;
+    case OP_ENTER: emit_frame(j, i, false); break;
+    JIT_BINARY(ADD, emit_binary, 0x03)
+    JIT_BINARY(MINUS, emit_binary, 0x2b)
+    JIT_BINARY(TIMES, emit_binary, 0x0faf)
+    JIT_BINARY(GT, emit_compare, CC_GT)
+    JIT_BINARY(GE, emit_compare, CC_GE)
+    JIT_BINARY(EQEQ, emit_compare, CC_EQ)
+    JIT_BINARY(NEQ, emit_compare, CC_NE)
+    JIT_BINARY(LT, emit_compare, CC_LT)
+    JIT_BINARY(LE, emit_compare, CC_LE)
+    JIT_IMMEDIATE(IADD, emit_ibinary, 0)
+    JIT_IMMEDIATE(IMINUS, emit_ibinary, 5)
+    JIT_IMMEDIATE(IGT, emit_icompare, CC_GT)
+    JIT_IMMEDIATE(IGE, emit_icompare, CC_GE)
+    JIT_IMMEDIATE(IEQEQ, emit_icompare, CC_EQ)
+    JIT_IMMEDIATE(INEQ, emit_icompare, CC_NE)
+    JIT_IMMEDIATE(ILT, emit_icompare, CC_LT)
+    JIT_IMMEDIATE(ILE, emit_icompare, CC_LE)
+    case OP_INC: emit_inc(j, e, i, true, R12, GLOBAL_DISP(a)); break;
+    case OP_INC_LONG: emit_inc(j, e, i, false, R12, GLOBAL_DISP(a)); break;
+    case OP_INC_LOCAL: emit_inc(j, e, i, true, R13, LOCAL_DISP(a)); break;
+    case OP_INC_LOCAL_LONG: emit_inc(j, e, i, false, R13, LOCAL_DISP(a)); break;
+    case OP_LOAD_BOOL:
+      emit_store_long(j, VT_BOOL, e->constants[a].bval);
+      break;
+    case OP_LOAD_LONG:
+      emit_store_long(j, VT_LONG, e->constants[a].lval);
+      break;
+    case OP_LOAD_DOUBLE: {
+      int64_t l;
+      memcpy(&l, &e->constants[a].dval, sizeof(l));
+      emit_store_long(j, VT_DOUBLE, l);
+      break;
+    }
+    case OP_LOAD_IDENT:
+      emit_copy(j, R12, GLOBAL_DISP(a), RBX, 0);
+      emit_lea_rbx(j, VALUE_SIZE);
+      break;
+    case OP_LOAD_LOCAL_IDENT:
+      emit_copy(j, R13, LOCAL_DISP(a), RBX, 0);
+      emit_lea_rbx(j, VALUE_SIZE);
+      break;
+    case OP_LOAD_LOCAL_IDENT2:
+      emit_copy(j, R13, LOCAL_DISP(a), RBX, 0);
+      emit_copy(j, R13, LOCAL_DISP(GET_ARG_B(e->codes[i])), RBX, VALUE_SIZE);
+      emit_lea_rbx(j, 2 * VALUE_SIZE);
+      break;
+    case OP_LOAD_FUNC:
+      emit_store_long(j, VT_LONG, i + a + 1);
+      break;
+    case OP_HALT:
+      emit(j, 3, 0x48, 0x89, 0xd8);          // mov rax, rbx
+      emit(j, 4, 0x48, 0x83, 0xc4, 0x08);    // add rsp, 8
+      emit(j, 4, 0x41, 0x5f, 0x41, 0x5e);    // pop r15; pop r14
+      emit(j, 4, 0x41, 0x5d, 0x41, 0x5c);    // pop r13; pop r12
+      emit(j, 3, 0x5d, 0x5b, 0xc3);          // pop rbp; pop rbx; ret
+      break;
+    default:
+      emit_call(j, (void*)jit_step, i);
+      emit(j, 3, 0x48, 0x89, 0xc3);          // mov rbx, rax
+      break;
+  }
+}
+
+static void execute_jit(env* e) {
+  jit_code j;
+  int i;
+  uint8_t* code;
+  void** table;
+  value* (*f)(value*, variable*, variable*, env*, void**);
+  j.codelen = 4096;
+  j.code = malloc(j.codelen);
+  j.codeidx = 0;
+  j.addrs = calloc(e->codesidx, sizeof(uint32_t));
+  j.fixupslen = 64;
+  j.fixups = malloc(j.fixupslen * sizeof(jit_fixup));
+  j.fixupsidx = 0;
+  emit(&j, 4, 0x53, 0x55, 0x41, 0x54);       // push rbx; push rbp; push r12
+  emit(&j, 4, 0x41, 0x55, 0x41, 0x56);       // push r13; push r14
+  emit(&j, 2, 0x41, 0x57);                   // push r15
+  emit(&j, 4, 0x48, 0x83, 0xec, 0x08);       // sub rsp, 8
+  emit(&j, 3, 0x48, 0x89, 0xfb);             // mov rbx, rdi
+  emit(&j, 3, 0x49, 0x89, 0xf4);             // mov r12, rsi
+  emit(&j, 3, 0x49, 0x89, 0xd5);             // mov r13, rdx
+  emit(&j, 3, 0x49, 0x89, 0xce);             // mov r14, rcx
+  emit(&j, 3, 0x4d, 0x89, 0xc7);             // mov r15, r8
+  for (i = 0; i < e->codesidx; ++i) {
+    j.addrs[i] = j.codeidx;
+    jit_instruction(&j, e, i);
+  }
+  for (i = 0; i < j.fixupsidx; ++i) {
+    int32_t rel = j.addrs[j.fixups[i].pc] - (j.fixups[i].pos + 4);
+    memcpy(j.code + j.fixups[i].pos, &rel, 4);
+  }
+  code = mmap(NULL, j.codeidx, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    printf("mmap failed\n");
+    exit(1);
+  }
+  memcpy(code, j.code, j.codeidx);
+  if (mprotect(code, j.codeidx, PROT_READ | PROT_EXEC)) {
+    printf("mprotect failed\n");
+    exit(1);
+  }
+  table = malloc(e->codesidx * sizeof(void*));
+  for (i = 0; i < e->codesidx; ++i)
+    table[i] = code + j.addrs[i];
+  alloc_stack(e);
+  init_frames(e);
+  f = (value* (*)(value*, variable*, variable*, env*, void**))code;
+  e->stackidx = f(e->stack, e->variables, e->variables + e->frames[0].base, e, table) - e->stack;
+  munmap(code, j.codeidx);
+  free(table);
+  free(j.code);
+  free(j.addrs);
+  free(j.fixups);
+  if (e->stackidx != 0) {
+    printf("stack not consumed\n");
+    exit(1);
+  }
+}
+
+#else
+
+static void execute_jit(env* e) {
+  execute_codes(e);
+}
+
+#endif
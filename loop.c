@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "node.h"
+#include "state.h"
+#include "vm.h"
+#include "y.tab.h"
+
+/*
+ * Moves work that is the same on every iteration out of while and for loops.
+ * Runs on the syntax tree after infer, which it reads the variable types of.
+ *   - A subexpression that reads only variables the loop never assigns is
+ *     computed once into a temporary before the loop. Calls stay in place since
+ *     they may print or read the input, and so do divisions by anything but a
+ *     literal other than 0 and -1, which could fault where the loop would not.
+ *   - In a while loop, i * k with a long literal k, where i is a long only
+ *     assigned by i = i + c or i = i - c with a long literal c, becomes a
+ *     temporary set to i * k before the loop and increased by c * k right after
+ *     each assignment to i.
+ * A loop assigns the targets of its assignments and for loops. A function only
+ * assigns its own locals, so calls change none of them. Loops defining a
+ * function are left alone. Temporaries are named $0, $1, ..., which no
+ * identifier can be, and are locals in a function.
+ */
+
+typedef struct product {
+  char* name;
+  long k;
+  char* temp;
+} product;
+
+typedef struct loops {
+  env* e;
+  state* s;
+  int temps;
+  char** assigned;
+  uint32_t assignedlen;
+  uint32_t assignedcap;
+  product* products;
+  uint32_t productslen;
+  uint32_t productscap;
+  node* loop;
+  node* first;
+  node* last;
+} loops;
+
+static bool is_assigned_name(loops* l, char* name) {
+  int i;
+  for (i = 0; i < l->assignedlen; ++i)
+    if (l->assigned[i] == name)
+      return true;
+  return false;
+}
+
+static void add_assigned_name(loops* l, char* name) {
+  if (is_assigned_name(l, name))
+    return;
+  if (l->assignedlen == l->assignedcap) {
+    l->assignedcap = l->assignedcap ? l->assignedcap * 2 : 16;
+    l->assigned = realloc(l->assigned, l->assignedcap * sizeof(char*));
+  }
+  l->assigned[l->assignedlen++] = name;
+}
+
+// Collects the names n assigns, or returns false if it defines a function.
+static bool collect_assigned(loops* l, node* n) {
+  node* m;
+  switch (n->type) {
+    case NODE_FUNCTION:
+      return false;
+    case NODE_ASSIGN:
+      add_assigned_name(l, n->name);
+      break;
+    case NODE_STMTS:
+      for (m = n->stmts; m != NULL; m = m->next)
+        if (!collect_assigned(l, m))
+          return false;
+      break;
+    case NODE_IF:
+      if (!collect_assigned(l, n->body))
+        return false;
+      return n->orelse == NULL || collect_assigned(l, n->orelse);
+    case NODE_WHILE:
+      return collect_assigned(l, n->body);
+    case NODE_FOR:
+      add_assigned_name(l, n->name);
+      return collect_assigned(l, n->body);
+  }
+  return true;
+}
+
+static bool is_invariant(loops* l, node* n) {
+  switch (n->type) {
+    case NODE_BOOL: case NODE_LONG: case NODE_DOUBLE:
+      return true;
+    case NODE_IDENTIFIER:
+      return !is_assigned_name(l, n->name);
+    case NODE_UNARYOP:
+      return is_invariant(l, n->expr);
+    case NODE_BINOP:
+      if (n->op == DIVIDE && n->rhs->type != NODE_DOUBLE &&
+          (n->rhs->type != NODE_LONG || n->rhs->lval == 0 || n->rhs->lval == -1))
+        return false;
+      return is_invariant(l, n->lhs) && is_invariant(l, n->rhs);
+    default:
+      return false;
+  }
+}
+
+static bool same_expr(node* n, node* m) {
+  if (n->type != m->type)
+    return false;
+  switch (n->type) {
+    case NODE_BOOL: return n->bval == m->bval;
+    case NODE_LONG: return n->lval == m->lval;
+    case NODE_DOUBLE: return memcmp(&n->dval, &m->dval, sizeof(double)) == 0;
+    case NODE_IDENTIFIER: return n->name == m->name;
+    case NODE_UNARYOP: return n->op == m->op && same_expr(n->expr, m->expr);
+    case NODE_BINOP:
+      return n->op == m->op && same_expr(n->lhs, m->lhs) && same_expr(n->rhs, m->rhs);
+    default: return false;
+  }
+}
+
+static char* new_temp(loops* l) {
+  char buf[16];
+  int len = snprintf(buf, sizeof(buf), "$%d", l->temps++);
+  return intern(l->s, buf, len);
+}
+
+// Appends temp = expr to the statements put before the loop.
+static void add_preheader(loops* l, char* temp, node* expr, uint32_t line) {
+  node* m = new_assign(l->s, temp, expr);
+  m->line = line;
+  if (l->first == NULL)
+    l->first = m;
+  else
+    l->last->next = m;
+  l->last = m;
+}
+
+// Replaces *p, which may be an argument of a call, with a read of temp.
+static void replace_expr(loops* l, node** p, char* temp) {
+  node* m = new_identifier(l->s, temp);
+  m->line = (*p)->line;
+  m->next = (*p)->next;
+  (*p)->next = NULL;
+  *p = m;
+}
+
+typedef void (*expr_visitor)(loops*, node**);
+
+static void visit_operands(loops* l, node* n, expr_visitor f) {
+  node** p;
+  switch (n->type) {
+    case NODE_UNARYOP:
+      f(l, &n->expr);
+      break;
+    case NODE_BINOP:
+      f(l, &n->lhs);
+      f(l, &n->rhs);
+      break;
+    case NODE_FCALL:
+      for (p = &n->args; *p != NULL; p = &(*p)->next)
+        f(l, p);
+      break;
+  }
+}
+
+// Calls f on every outermost expression of the statement n.
+static void visit_exprs(loops* l, node* n, expr_visitor f) {
+  node** p;
+  switch (n->type) {
+    case NODE_ASSIGN:
+    case NODE_RETURN:
+    case NODE_PRINT:
+      if (n->expr != NULL)
+        f(l, &n->expr);
+      break;
+    case NODE_STMTS:
+      for (p = &n->stmts; *p != NULL; p = &(*p)->next)
+        visit_exprs(l, *p, f);
+      break;
+    case NODE_IF:
+      f(l, &n->cond);
+      visit_exprs(l, n->body, f);
+      if (n->orelse != NULL)
+        visit_exprs(l, n->orelse, f);
+      break;
+    case NODE_WHILE:
+      f(l, &n->cond);
+      visit_exprs(l, n->body, f);
+      break;
+    case NODE_FOR:
+      for (p = &n->args; *p != NULL; p = &(*p)->next)
+        f(l, p);
+      visit_exprs(l, n->body, f);
+      break;
+  }
+}
+
+static void hoist_expr(loops* l, node** p) {
+  node* n = *p, *m;
+  if ((n->type != NODE_UNARYOP && n->type != NODE_BINOP) || !is_invariant(l, n)) {
+    visit_operands(l, n, hoist_expr);
+    return;
+  }
+  for (m = l->first; m != NULL; m = m->next)
+    if (same_expr(m->expr, n))
+      break;
+  if (m == NULL) {
+    replace_expr(l, p, new_temp(l));
+    add_preheader(l, (*p)->name, n, n->line);
+  } else {
+    replace_expr(l, p, m->name);
+  }
+}
+
+static bool is_step(node* n, char* name) {
+  return n->type == NODE_BINOP && (n->op == PLUS || n->op == MINUS) &&
+    n->lhs->type == NODE_IDENTIFIER && n->lhs->name == name && n->rhs->type == NODE_LONG;
+}
+
+// Whether every assignment to name in n adds or subtracts a long literal.
+static bool only_steps(node* n, char* name) {
+  node* m;
+  switch (n->type) {
+    case NODE_ASSIGN:
+      return n->name != name || is_step(n->expr, name);
+    case NODE_STMTS:
+      for (m = n->stmts; m != NULL; m = m->next)
+        if (!only_steps(m, name))
+          return false;
+      return true;
+    case NODE_IF:
+      return only_steps(n->body, name) && (n->orelse == NULL || only_steps(n->orelse, name));
+    case NODE_WHILE:
+      return only_steps(n->body, name);
+    case NODE_FOR:
+      return n->name != name && only_steps(n->body, name);
+    default:
+      return true;
+  }
+}
+
+static bool is_induction(loops* l, char* name) {
+  variable_index vi;
+  int8_t* t;
+  if (!is_assigned_name(l, name) || !only_steps(l->loop->body, name))
+    return false;
+  vi = lookup(l->e, name, false);
+  if (vi.index < 0 || (l->e->local_variables != NULL && vi.global))
+    return false;
+  t = variable_type(l->e, vi);
+  return t != NULL && *t == VT_LONG;
+}
+
+static void reduce_expr(loops* l, node** p) {
+  node* n = *p;
+  char* name = NULL;
+  long k = 0;
+  int i;
+  if (n->type == NODE_BINOP && n->op == TIMES) {
+    if (n->lhs->type == NODE_IDENTIFIER && n->rhs->type == NODE_LONG)
+      name = n->lhs->name, k = n->rhs->lval;
+    else if (n->lhs->type == NODE_LONG && n->rhs->type == NODE_IDENTIFIER)
+      name = n->rhs->name, k = n->lhs->lval;
+  }
+  if (name == NULL || !is_induction(l, name)) {
+    visit_operands(l, n, reduce_expr);
+    return;
+  }
+  for (i = 0; i < l->productslen; ++i)
+    if (l->products[i].name == name && l->products[i].k == k)
+      break;
+  if (i == l->productslen) {
+    if (l->productslen == l->productscap) {
+      l->productscap = l->productscap ? l->productscap * 2 : 8;
+      l->products = realloc(l->products, l->productscap * sizeof(product));
+    }
+    l->products[l->productslen++] = (product){ name, k, new_temp(l) };
+  }
+  replace_expr(l, p, l->products[i].temp);
+}
+
+// Follows each assignment to the product's variable with one to its temporary.
+static void insert_updates(loops* l, node* n, product* r) {
+  node* m, *u;
+  unsigned long c;
+  switch (n->type) {
+    case NODE_STMTS:
+      for (m = n->stmts; m != NULL; m = m->next) {
+        if (m->type != NODE_ASSIGN || m->name != r->name) {
+          insert_updates(l, m, r);
+          continue;
+        }
+        c = m->expr->rhs->lval;
+        if (m->expr->op == MINUS)
+          c = -c;
+        u = new_assign(l->s, r->temp, new_binop(l->s, PLUS, new_identifier(l->s, r->temp),
+              new_long(l->s, (long)(c * (unsigned long)r->k))));
+        u->line = u->expr->line = u->expr->lhs->line = u->expr->rhs->line = m->line;
+        u->next = m->next;
+        m->next = u;
+        m = u;
+      }
+      break;
+    case NODE_IF:
+      insert_updates(l, n->body, r);
+      if (n->orelse != NULL)
+        insert_updates(l, n->orelse, r);
+      break;
+    case NODE_WHILE:
+    case NODE_FOR:
+      insert_updates(l, n->body, r);
+      break;
+  }
+}
+
+// Rewrites the loop n and returns the statements to put before it, or NULL.
+static node* optimize_loop(loops* l, node* n) {
+  node* m;
+  int i;
+  l->assignedlen = l->productslen = 0;
+  l->loop = n;
+  l->first = l->last = NULL;
+  if (!collect_assigned(l, n))
+    return NULL;
+  if (n->type == NODE_WHILE) {
+    reduce_expr(l, &n->cond);
+    visit_exprs(l, n->body, reduce_expr);
+    for (i = 0; i < l->productslen; ++i) {
+      insert_updates(l, n->body, &l->products[i]);
+      add_assigned_name(l, l->products[i].temp);
+      m = new_binop(l->s, TIMES, new_identifier(l->s, l->products[i].name),
+          new_long(l->s, l->products[i].k));
+      m->line = m->lhs->line = m->rhs->line = n->line;
+      add_preheader(l, l->products[i].temp, m, n->line);
+    }
+    hoist_expr(l, &n->cond);
+  }
+  visit_exprs(l, n->body, hoist_expr);
+  return l->first;
+}
+
+// Follows the variable lookups of infer, so that the types of the variables at
+// each loop can be found.
+static void optimize_loops_stmt(loops* l, node* n) {
+  env* e = l->e;
+  node** p, *m, *pre;
+  switch (n->type) {
+    case NODE_FUNCTION:
+      lookup(e, n->name, true);
+      new_local_variables(e);
+      e->local_variable_types = e->function_types[e->functionsidx++];
+      declare_args(e, n->params);
+      optimize_loops_stmt(l, n->body);
+      free(e->local_variables);
+      e->local_variables = NULL;
+      e->local_variables_len = 0;
+      e->local_variable_types = NULL;
+      break;
+    case NODE_STMTS:
+      for (p = &n->stmts; *p != NULL; p = &(*p)->next) {
+        m = *p;
+        if ((m->type == NODE_WHILE || m->type == NODE_FOR) && (pre = optimize_loop(l, m)) != NULL) {
+          for (*p = pre; pre->next != NULL; pre = pre->next);
+          pre->next = m;
+          p = &pre->next;
+        }
+        optimize_loops_stmt(l, m);
+      }
+      break;
+    case NODE_ASSIGN:
+      if (n->name[0] != '$')
+        lookup(e, n->name, true);
+      break;
+    case NODE_IF:
+      optimize_loops_stmt(l, n->body);
+      if (n->orelse != NULL)
+        optimize_loops_stmt(l, n->orelse);
+      break;
+    case NODE_WHILE:
+      optimize_loops_stmt(l, n->body);
+      break;
+    case NODE_FOR:
+      lookup(e, n->name, true);
+      optimize_loops_stmt(l, n->body);
+      break;
+  }
+}
+
+// Returns whether anything was moved, in which case the types are stale.
+static bool optimize_loops(env* e, state* s, node* n) {
+  loops l = { e, s, 0, NULL, 0, 0, NULL, 0, 0, NULL, NULL, NULL };
+  optimize_loops_stmt(&l, n);
+  clear_variable_names(e);
+  free(l.assigned);
+  free(l.products);
+  return l.temps > 0;
+}
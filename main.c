@@ -3,28 +3,194 @@
 #include "lex.yy.h"
 #include "y.tab.h"
 #include "codegen.c"
+#include "infer.c"
+#include "optimize.c"
+#include "fold.c"
+#include "loop.c"
 #include "vm.c"
+#include "verify.c"
+#include "stats.c"
+#include "profile.c"
+#include "jit.c"
+#include "emitc.c"
+#include "register.c"
+#include "bytecode.c"
 int yyparse();
 
+static void run(env* e, bool c, bool jit, int prof, stats* st) {
+  double start = now();
+  if (c)
+    emit_c(e);
+  else if (prof)
+    execute_profile(e, prof, st);
+  else if (jit)
+    execute_jit(e);
+  else if (st != NULL)
+    execute_codes_count(e, &st->instructions);
+  else
+    execute_codes(e);
+  if (st != NULL) {
+    st->execute_time = now() - start;
+    if (!c && !prof) {
+      st->max_stack = max_stack_depth(e);
+      st->max_frames = e->max_frames;
+    }
+    fflush(stdout);
+  }
+}
+
 int main(int argc, const char* argv[])
 {
+  int i;
+  bool debug = false, jit = false, c = false, reg = false, json = false;
+  int prof = 0;
+  stats st, *pst = NULL;
+  double start = now();
+  const char* compile = NULL, *file = NULL, *input_file = NULL;
+  init_output();
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--debug"))
+      debug = true;
+    else if (!strcmp(argv[i], "--jit"))
+      jit = true;
+    else if (!strcmp(argv[i], "--emit-c"))
+      c = true;
+    else if (!strcmp(argv[i], "--register"))
+      reg = true;
+    else if (!strcmp(argv[i], "--profile"))
+      prof = 1;
+    else if (!strcmp(argv[i], "--profile-cycles"))
+      prof = 2;
+    else if (!strcmp(argv[i], "--stats"))
+      pst = &st;
+    else if (!strcmp(argv[i], "--stats-json"))
+      pst = &st, json = true;
+    else if (!strcmp(argv[i], "--compile") && i + 1 < argc)
+      compile = argv[++i];
+    else if (!strcmp(argv[i], "--input") && i + 1 < argc)
+      input_file = argv[++i];
+    else if (argv[i][0] != '-')
+      file = argv[i];
+  }
+  if (input_file != NULL && (input.fd = open(input_file, O_RDONLY)) < 0) {
+    printf("Cannot open %s\n", input_file);
+    exit(1);
+  }
+  init_stats(&st);
+  env* e = new_env();
+  if (file != NULL && is_bytecode_file(file)) {
+    if (reg) {
+      printf("--register cannot run a bytecode file\n");
+      exit(1);
+    }
+    load_bytecode(e, file);
+    verify_codes(e);
+    st.load_time = now() - start;
+    count_codes(&st, e);
+    if (debug)
+      print_codes(e);
+    run(e, c, jit, prof, pst);
+    if (pst != NULL)
+      print_stats(pst, json);
+    free_env(e);
+    return 0;
+  }
   state* s = new_state();
   if (s == NULL)
     exit(1);
-  yylex_init(&s->scanner);
-  yyset_in(stdin, s->scanner);
+  // Builtins are resolved by comparing with the interned identifiers.
+  for (i = 0; i < sizeof(gfuncs) / sizeof(func); ++i)
+    intern_static(s, gfuncs[i].name);
+  yylex_init_extra(s, &s->scanner);
+  FILE* in = stdin;
+  if (file != NULL && (in = fopen(file, "r")) == NULL) {
+    printf("Cannot open %s\n", file);
+    exit(1);
+  }
+  // read() must not consume the source, so it needs --input when stdin holds it.
+  if (file == NULL && input_file == NULL)
+    input.fd = -1;
+  size_t length = 0;
+  char* source = NULL;
+  if (compile != NULL) {
+    // The source is hashed, and a file compiled from the same source is left
+    // as it is unless the code is to be printed.
+    source = read_source(in, &length);
+    if (in != stdin)
+      fclose(in);
+    if (!debug && pst == NULL && is_bytecode_current(compile, hash_source(source, length))) {
+      free(source);
+      yylex_destroy(s->scanner);
+      free_state(s);
+      free_env(e);
+      return 0;
+    }
+    in = fmemopen(source, length, "r");
+  }
+  yyset_in(in, s->scanner);
   if (yyparse(s)) {
     yylex_destroy(s->scanner);
     exit(1);
   }
-  if (argc > 1 && !strcmp(argv[1], "--debug"))
+  yylex_destroy(s->scanner);
+  if (in != stdin)
+    fclose(in);
+  s->node = fold(s, s->node);
+  st.parse_time = now() - start;
+  count_nodes(&st, s);
+  if (debug)
     print_node(s->node, 0);
-  env* e = new_env();
+  if (reg) {
+    start = now();
+    reg_program* p = reg_codegen(e, s->node);
+    st.codegen_time = now() - start;
+    free_state(s);
+    if (debug)
+      print_reg_codes(p);
+    start = now();
+    execute_registers(e, p);
+    st.execute_time = now() - start;
+    st.max_frames = e->max_frames;
+    if (pst != NULL) {
+      fflush(stdout);
+      print_stats(pst, json);
+    }
+    free_reg_program(p);
+    free_env(e);
+    return 0;
+  }
+  start = now();
+  infer(e, s->node);
+  if (optimize_loops(e, s, s->node))
+    infer(e, s->node);
   codegen(e, s->node);
-  if (argc > 1 && !strcmp(argv[1], "--debug"))
+  addcode(e, OP_HALT);
+  st.codegen_time = now() - start;
+  // The code no longer refers to the syntax tree or the identifiers, but the
+  // profile names functions after the variables holding them.
+  if (!prof)
+    free_state(s);
+  if (debug) {
+    printf("typed %d/%d\n", e->typed_ops, e->typed_ops + e->untyped_ops);
     print_codes(e);
-  execute_codes(e);
+  }
+  start = now();
+  optimize_codes(e);
+  verify_codes(e);
+  st.optimize_time = now() - start;
+  count_codes(&st, e);
+  if (debug) {
+    printf("\n");
+    print_codes(e);
+  }
+  if (compile != NULL)
+    write_bytecode(e, compile, hash_source(source, length));
+  else
+    run(e, c, jit, prof, pst);
+  if (pst != NULL)
+    print_stats(pst, json);
+  if (prof)
+    free_state(s);
+  free(source);
   free_env(e);
-  yylex_destroy(s->scanner);
-  free_state(s);
 }
@@ -4,44 +4,148 @@
 #include "state.h"
 #include "y.tab.h"
 
-node* new_cons(state* s, node* car, node* cdr) {
+node* new_leaf(state* s, int type) {
   node* n = new_node(s);
-  n->car = car;
-  n->cdr = cdr;
+  n->type = type;
   return n;
 }
 
-node* append(node* n, node* m) {
-  node* k = n;
-  while (k->cdr != NULL) {
-    k = k->cdr;
-  }
-  k->cdr = m;
+node* new_function(state* s, char* name, node* params, node* body) {
+  node* n = new_leaf(s, NODE_FUNCTION);
+  n->name = name;
+  n->params = params;
+  n->body = body;
+  return n;
+}
+
+node* new_return(state* s, node* expr) {
+  node* n = new_leaf(s, NODE_RETURN);
+  n->expr = expr;
+  return n;
+}
+
+node* new_print(state* s, node* expr) {
+  node* n = new_leaf(s, NODE_PRINT);
+  n->expr = expr;
+  return n;
+}
+
+node* new_stmts(state* s, node* stmt) {
+  node* n = new_leaf(s, NODE_STMTS);
+  n->stmts = n->last = stmt;
+  return n;
+}
+
+node* append_stmt(node* n, node* stmt) {
+  n->last = n->last->next = stmt;
+  return n;
+}
+
+node* new_assign(state* s, char* name, node* expr) {
+  node* n = new_leaf(s, NODE_ASSIGN);
+  n->name = name;
+  n->expr = expr;
+  return n;
+}
+
+node* new_if(state* s, node* cond, node* body, node* orelse) {
+  node* n = new_leaf(s, NODE_IF);
+  n->line = cond->line;
+  n->cond = cond;
+  n->body = body;
+  n->orelse = orelse;
+  return n;
+}
+
+node* new_while(state* s, node* cond, node* body) {
+  node* n = new_leaf(s, NODE_WHILE);
+  n->line = cond->line;
+  n->cond = cond;
+  n->body = body;
+  return n;
+}
+
+node* new_for(state* s, char* name, node* start, node* limit, node* step, node* body) {
+  node* n = new_leaf(s, NODE_FOR);
+  n->line = start->line;
+  n->name = name;
+  n->args = start;
+  start->next = limit;
+  limit->next = step;
+  n->body = body;
+  return n;
+}
+
+node* new_fcall(state* s, char* name, node* args) {
+  node* n = new_leaf(s, NODE_FCALL);
+  n->name = name;
+  n->args = args;
   return n;
 }
 
-node* new_uop(state* s, int op, node* n) {
-  return new_cons(s, nint(NODE_UNARYOP), new_cons(s, nint(op), n));
+node* new_uop(state* s, int op, node* expr) {
+  node* n = new_leaf(s, NODE_UNARYOP);
+  n->op = op;
+  n->expr = expr;
+  return n;
 }
 
 node* new_binop(state* s, int op, node* lhs, node* rhs) {
-  return new_cons(s, nint(NODE_BINOP), new_cons(s, nint(op), new_cons(s, lhs, rhs)));
+  node* n = new_leaf(s, NODE_BINOP);
+  n->op = op;
+  n->lhs = lhs;
+  n->rhs = rhs;
+  return n;
+}
+
+node* new_bool(state* s, bool b) {
+  node* n = new_leaf(s, NODE_BOOL);
+  n->bval = b;
+  return n;
+}
+
+node* new_long(state* s, long l) {
+  node* n = new_leaf(s, NODE_LONG);
+  n->lval = l;
+  return n;
+}
+
+node* new_double(state* s, double d) {
+  node* n = new_leaf(s, NODE_DOUBLE);
+  n->dval = d;
+  return n;
+}
+
+node* new_identifier(state* s, char* name) {
+  node* n = new_leaf(s, NODE_IDENTIFIER);
+  n->name = name;
+  return n;
+}
+
+// Appends m to the list of arguments or parameters starting at n.
+node* append(node* n, node* m) {
+  node* k = n;
+  while (k->next != NULL) {
+    k = k->next;
+  }
+  k->next = m;
+  return n;
 }
 
 void print_uop(node* n, int indent) {
-  switch (intn(n->car)) {
+  switch (n->op) {
     case NOT: printf("(!)"); break;
     case PLUS: printf("(+)"); break;
     case MINUS: printf("(-)"); break;
     default:
-      printf("unknown unary operator %d", intn(n->car));
+      printf("unknown unary operator %d", n->op);
       exit(1);
   }
-  print_node(n->cdr, indent + 2);
+  print_node(n->expr, indent + 2);
 }
 
 void print_binop(node* n, int indent) {
-  switch (intn(n->car)) {
+  switch (n->op) {
     case OR: printf("(||)"); break;
     case AND: printf("(&&)"); break;
     case PLUS: printf("(+)"); break;
@@ -55,11 +159,11 @@ void print_binop(node* n, int indent) {
     case LT: printf("(<)"); break;
     case LE: printf("(<=)"); break;
     default:
-      printf("unknown binary operator %d", intn(n->car));
+      printf("unknown binary operator %d", n->op);
       exit(1);
   }
-  print_node(n->cdr->car, indent + 2);
-  print_node(n->cdr->cdr, indent + 2);
+  print_node(n->lhs, indent + 2);
+  print_node(n->rhs, indent + 2);
 }
 
 void print_node(node* n, int indent) {
@@ -72,54 +176,59 @@ void print_node(node* n, int indent) {
     printf(" ");
   }
   printf("(");
-  switch (intn(n->car)) {
+  switch (n->type) {
     case NODE_FUNCTION: {
-      node* m = n->cdr->cdr->car;
-      printf("func %s (", (char*)n->cdr->car);
+      node* m = n->params;
+      printf("func %s (", n->name);
       while (m != NULL) {
-        printf("%s", (char*)m->car);
-        m = m->cdr;
+        printf("%s", m->name);
+        m = m->next;
         if (m != NULL)
           printf(", ");
       }
       printf(")");
-      print_node(n->cdr->cdr->cdr, indent + 2);
+      print_node(n->body, indent + 2);
       break;
     }
     case NODE_RETURN:
       printf("return (");
-      print_node(n->cdr, indent + 2);
+      print_node(n->expr, indent + 2);
       printf(")");
       break;
     case NODE_STMTS:
-      n = n->cdr;
-      while (n != NULL) {
-        print_node(n->car, indent + 2);
-        n = n->cdr;
-      }
+      for (n = n->stmts; n != NULL; n = n->next)
+        print_node(n, indent + 2);
       break;
     case NODE_ASSIGN:
-      printf("let %s", (char*)n->cdr->car);
-      print_node(n->cdr->cdr, indent + 2);
+      printf("let %s", n->name);
+      print_node(n->expr, indent + 2);
       break;
     case NODE_IF:
       printf("if");
-      print_node(n->cdr->car, indent + 2);
-      print_node(n->cdr->cdr->car, indent + 2);
-      if (n->cdr->cdr->cdr != NULL) {
+      print_node(n->cond, indent + 2);
+      print_node(n->body, indent + 2);
+      if (n->orelse != NULL) {
         printf("\n");
         for (i = 0; i < indent; i++) {
           printf(" ");
         }
         printf("else");
-        print_node(n->cdr->cdr->cdr, indent + 2);
+        print_node(n->orelse, indent + 2);
       }
       break;
     case NODE_WHILE:
       printf("while");
-      print_node(n->cdr->car, indent + 2);
-      print_node(n->cdr->cdr, indent + 2);
+      print_node(n->cond, indent + 2);
+      print_node(n->body, indent + 2);
+      break;
+    case NODE_FOR: {
+      node* m;
+      printf("for %s", n->name);
+      for (m = n->args; m != NULL; m = m->next)
+        print_node(m, indent + 2);
+      print_node(n->body, indent + 2);
       break;
+    }
     case NODE_BREAK:
       printf("break");
       break;
@@ -128,41 +237,38 @@ void print_node(node* n, int indent) {
       break;
     case NODE_PRINT:
       printf("print");
-      print_node(n->cdr, indent + 2);
+      print_node(n->expr, indent + 2);
       break;
     case NODE_FCALL: {
       node* m;
-      printf("call %s", (char*)n->cdr->car);
-      m = n->cdr->cdr;
-      while (m != NULL) {
-        print_node(m->car, indent + 2);
-        m = m->cdr;
-      }
+      printf("call %s", n->name);
+      for (m = n->args; m != NULL; m = m->next)
+        print_node(m, indent + 2);
       break;
    }
     case NODE_UNARYOP:
-      print_uop(n->cdr, indent);
+      print_uop(n, indent);
       break;
     case NODE_BINOP:
-      print_binop(n->cdr, indent);
+      print_binop(n, indent);
       break;
     case NODE_BOOL:
-      if ((intptr_t)n->cdr == 1)
+      if (n->bval)
         printf("bool true");
       else
         printf("bool false");
       break;
     case NODE_DOUBLE:
-      printf("double %lf", strtod((char*)n->cdr, NULL));
+      printf("double %lf", n->dval);
       break;
     case NODE_LONG:
-      printf("long %ld", atol((char*)n->cdr));
+      printf("long %ld", n->lval);
       break;
     case NODE_IDENTIFIER:
-      printf("identifier %s", (char*)n->cdr);
+      printf("identifier %s", n->name);
       break;
     default:
-      printf("Unknown node %d", intn(n->car));
+      printf("Unknown node %d", n->type);
       exit(1);
   }
   printf(")");
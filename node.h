@@ -2,9 +2,7 @@
 #define NODE_H
 
 #include <stdint.h>
-
-#define nint(x) ((node*)(intptr_t)(x))
-#define intn(x) ((int)(intptr_t)(x))
+#include <stdbool.h>
 
 enum node_type {
   NODE_FUNCTION,
@@ -13,6 +11,7 @@ enum node_type {
   NODE_ASSIGN,
   NODE_IF,
   NODE_WHILE,
+  NODE_FOR,
   NODE_BREAK,
   NODE_CONTINUE,
   NODE_PRINT,
@@ -25,14 +24,67 @@ enum node_type {
   NODE_IDENTIFIER,
 };
 
+// A syntax tree node. The fields each type uses:
+//   NODE_FUNCTION    name, params, body
+//   NODE_RETURN      expr
+//   NODE_STMTS       stmts, last (only kept up to date while parsing)
+//   NODE_ASSIGN      name, expr
+//   NODE_IF          cond, body, orelse
+//   NODE_WHILE       cond, body
+//   NODE_FOR         name, args (start, limit and the optional step), body
+//   NODE_PRINT       expr
+//   NODE_FCALL       name, args
+//   NODE_UNARYOP     op, expr
+//   NODE_BINOP       op, lhs, rhs
+//   NODE_BOOL        bval
+//   NODE_LONG        lval
+//   NODE_DOUBLE      dval
+//   NODE_IDENTIFIER  name
+// Statements, arguments and parameters are chained through next.
 typedef struct node {
-  struct node *car, *cdr;
+  uint8_t type;
+  int16_t op;
+  uint32_t line;
+  struct node* next;
+  union {
+    char* name;
+    struct node* cond;
+    struct node* lhs;
+    struct node* stmts;
+    bool bval;
+    long lval;
+    double dval;
+  };
+  union {
+    struct node* expr;
+    struct node* rhs;
+    struct node* args;
+    struct node* params;
+    struct node* orelse;
+    struct node* last;
+  };
+  struct node* body;
 } node;
 
-node* new_cons();
+struct state;
+node* new_leaf(struct state*, int);
+node* new_function(struct state*, char*, node*, node*);
+node* new_return(struct state*, node*);
+node* new_print(struct state*, node*);
+node* new_stmts(struct state*, node*);
+node* append_stmt(node*, node*);
+node* new_assign(struct state*, char*, node*);
+node* new_if(struct state*, node*, node*, node*);
+node* new_while(struct state*, node*, node*);
+node* new_for(struct state*, char*, node*, node*, node*, node*);
+node* new_fcall(struct state*, char*, node*);
+node* new_uop(struct state*, int, node*);
+node* new_binop(struct state*, int, node*, node*);
+node* new_bool(struct state*, bool);
+node* new_long(struct state*, long);
+node* new_double(struct state*, double);
+node* new_identifier(struct state*, char*);
 node* append(node*, node*);
-node* new_uop();
-node* new_binop();
 void print_node(node*, int);
 
 #endif
@@ -9,9 +9,44 @@ enum OP_CODE {
   OP_JMP,
   OP_JMP_IF,
   OP_JMP_IFNOT,
-  OP_UFCALL,
-  OP_ALLOC,
-  OP_RET,
+  OP_JMP_IFNOT_GT,
+  OP_JMP_IFNOT_GE,
+  OP_JMP_IFNOT_EQEQ,
+  OP_JMP_IFNOT_NEQ,
+  OP_JMP_IFNOT_LT,
+  OP_JMP_IFNOT_LE,
+  OP_JMP_IFNOT_GT_LL,
+  OP_JMP_IFNOT_GE_LL,
+  OP_JMP_IFNOT_EQEQ_LL,
+  OP_JMP_IFNOT_NEQ_LL,
+  OP_JMP_IFNOT_LT_LL,
+  OP_JMP_IFNOT_LE_LL,
+  OP_JMP_IFNOT_GT_DD,
+  OP_JMP_IFNOT_GE_DD,
+  OP_JMP_IFNOT_EQEQ_DD,
+  OP_JMP_IFNOT_NEQ_DD,
+  OP_JMP_IFNOT_LT_DD,
+  OP_JMP_IFNOT_LE_DD,
+  OP_JMP_IFNOT_GT_LONG,
+  OP_JMP_IFNOT_GE_LONG,
+  OP_JMP_IFNOT_EQEQ_LONG,
+  OP_JMP_IFNOT_NEQ_LONG,
+  OP_JMP_IFNOT_LT_LONG,
+  OP_JMP_IFNOT_LE_LONG,
+  OP_JMP_IFNOT_GT_DOUBLE,
+  OP_JMP_IFNOT_GE_DOUBLE,
+  OP_JMP_IFNOT_EQEQ_DOUBLE,
+  OP_JMP_IFNOT_NEQ_DOUBLE,
+  OP_JMP_IFNOT_LT_DOUBLE,
+  OP_JMP_IFNOT_LE_DOUBLE,
+  OP_FORPREP,
+  OP_FORPREP_LOCAL,
+  OP_FORLOOP,
+  OP_FORLOOP_LOCAL,
+  OP_CALL,
+  OP_TAILCALL,
+  OP_ENTER,
+  OP_RETURN,
   OP_PRINT,
   OP_FCALL,
   OP_UNOT,
@@ -21,19 +56,116 @@ enum OP_CODE {
   OP_MINUS,
   OP_TIMES,
   OP_DIVIDE,
+  OP_ADD_LL,
+  OP_MINUS_LL,
+  OP_TIMES_LL,
+  OP_DIVIDE_LL,
+  OP_ADD_DD,
+  OP_MINUS_DD,
+  OP_TIMES_DD,
+  OP_DIVIDE_DD,
+  OP_ADD_LONG,
+  OP_MINUS_LONG,
+  OP_TIMES_LONG,
+  OP_DIVIDE_LONG,
+  OP_ADD_DOUBLE,
+  OP_MINUS_DOUBLE,
+  OP_TIMES_DOUBLE,
+  OP_DIVIDE_DOUBLE,
   OP_IADD,
   OP_IMINUS,
+  OP_IADD_LONG,
+  OP_IMINUS_LONG,
+  OP_INC,
+  OP_INC_LOCAL,
+  OP_INC_LONG,
+  OP_INC_LOCAL_LONG,
   OP_GT,
   OP_GE,
   OP_EQEQ,
   OP_NEQ,
   OP_LT,
   OP_LE,
+  OP_GT_LL,
+  OP_GE_LL,
+  OP_EQEQ_LL,
+  OP_NEQ_LL,
+  OP_LT_LL,
+  OP_LE_LL,
+  OP_GT_DD,
+  OP_GE_DD,
+  OP_EQEQ_DD,
+  OP_NEQ_DD,
+  OP_LT_DD,
+  OP_LE_DD,
+  OP_GT_LONG,
+  OP_GE_LONG,
+  OP_EQEQ_LONG,
+  OP_NEQ_LONG,
+  OP_LT_LONG,
+  OP_LE_LONG,
+  OP_GT_DOUBLE,
+  OP_GE_DOUBLE,
+  OP_EQEQ_DOUBLE,
+  OP_NEQ_DOUBLE,
+  OP_LT_DOUBLE,
+  OP_LE_DOUBLE,
+  OP_IGT,
+  OP_IGE,
+  OP_IEQEQ,
+  OP_INEQ,
+  OP_ILT,
+  OP_ILE,
+  OP_IGT_LONG,
+  OP_IGE_LONG,
+  OP_IEQEQ_LONG,
+  OP_INEQ_LONG,
+  OP_ILT_LONG,
+  OP_ILE_LONG,
   OP_LOAD_BOOL,
   OP_LOAD_LONG,
   OP_LOAD_DOUBLE,
   OP_LOAD_IDENT,
   OP_LOAD_LOCAL_IDENT,
+  OP_LOAD_LOCAL_IDENT2,
+  OP_LOAD_FUNC,
+  OP_HALT,
+};
+
+enum REG_OPCODE {
+  ROP_MOVE,
+  ROP_LOAD_FUNC,
+  ROP_JMP,
+  ROP_JMP_IF,
+  ROP_JMP_IFNOT,
+  ROP_JMP_IFNOT_GT,
+  ROP_JMP_IFNOT_GE,
+  ROP_JMP_IFNOT_EQEQ,
+  ROP_JMP_IFNOT_NEQ,
+  ROP_JMP_IFNOT_LT,
+  ROP_JMP_IFNOT_LE,
+  ROP_FORPREP,
+  ROP_FORLOOP,
+  ROP_CALL,
+  ROP_TAILCALL,
+  ROP_FCALL,
+  ROP_ENTER,
+  ROP_RETURN,
+  ROP_PRINT,
+  ROP_UNOT,
+  ROP_UADD,
+  ROP_UMINUS,
+  ROP_ADD,
+  ROP_MINUS,
+  ROP_TIMES,
+  ROP_DIVIDE,
+  ROP_GT,
+  ROP_GE,
+  ROP_EQEQ,
+  ROP_NEQ,
+  ROP_LT,
+  ROP_LE,
+  ROP_HALT,
 };
 
 #endif
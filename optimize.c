@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "opcode.h"
+#include "vm.h"
+
+static bool is_jump(uint8_t op) {
+  switch (op) {
+    case OP_JMP:
+    case OP_JMP_IF:
+    case OP_JMP_IFNOT:
+    case OP_JMP_IFNOT_GT:
+    case OP_JMP_IFNOT_GE:
+    case OP_JMP_IFNOT_EQEQ:
+    case OP_JMP_IFNOT_NEQ:
+    case OP_JMP_IFNOT_LT:
+    case OP_JMP_IFNOT_LE:
+    case OP_JMP_IFNOT_GT_LL: case OP_JMP_IFNOT_GE_LL: case OP_JMP_IFNOT_EQEQ_LL:
+    case OP_JMP_IFNOT_NEQ_LL: case OP_JMP_IFNOT_LT_LL: case OP_JMP_IFNOT_LE_LL:
+    case OP_JMP_IFNOT_GT_DD: case OP_JMP_IFNOT_GE_DD: case OP_JMP_IFNOT_EQEQ_DD:
+    case OP_JMP_IFNOT_NEQ_DD: case OP_JMP_IFNOT_LT_DD: case OP_JMP_IFNOT_LE_DD:
+    case OP_JMP_IFNOT_GT_LONG: case OP_JMP_IFNOT_GE_LONG: case OP_JMP_IFNOT_EQEQ_LONG:
+    case OP_JMP_IFNOT_NEQ_LONG: case OP_JMP_IFNOT_LT_LONG: case OP_JMP_IFNOT_LE_LONG:
+    case OP_JMP_IFNOT_GT_DOUBLE: case OP_JMP_IFNOT_GE_DOUBLE: case OP_JMP_IFNOT_EQEQ_DOUBLE:
+    case OP_JMP_IFNOT_NEQ_DOUBLE: case OP_JMP_IFNOT_LT_DOUBLE: case OP_JMP_IFNOT_LE_DOUBLE:
+    case OP_FORPREP: case OP_FORPREP_LOCAL: case OP_FORLOOP: case OP_FORLOOP_LOCAL:
+    case OP_LOAD_FUNC:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool falls_through(uint8_t op) {
+  return op != OP_JMP && op != OP_TAILCALL && op != OP_RETURN && op != OP_HALT;
+}
+
+static int jump_target(env* e, int i) {
+  return i + GET_ARG_A(e->codes[i]) + 1;
+}
+
+static void set_jump_target(env* e, int i, int target) {
+  e->codes[i] = (e->codes[i] & ~MK_ARG_A(0xffffffff)) | MK_ARG_A(target - i - 1);
+}
+
+static int thread_jump(env* e, int target) {
+  int count = 0;
+  while (GET_OPCODE(e->codes[target]) == OP_JMP && count++ < e->codesidx)
+    target = jump_target(e, target);
+  return target;
+}
+
+static bool thread_jumps(env* e) {
+  int i, target; bool changed = false;
+  for (i = 0; i < e->codesidx; ++i) {
+    uint8_t op = GET_OPCODE(e->codes[i]);
+    if (is_jump(op)) {
+      target = thread_jump(e, jump_target(e, i));
+      if (target != jump_target(e, i)) {
+        set_jump_target(e, i, target);
+        changed = true;
+      }
+      if (op == OP_JMP && (GET_OPCODE(e->codes[target]) == OP_RETURN ||
+                           GET_OPCODE(e->codes[target]) == OP_HALT)) {
+        e->codes[i] = e->codes[target];
+        changed = true;
+      }
+    } else if (op == OP_DUP && i + 2 < e->codesidx &&
+               (GET_OPCODE(e->codes[i + 1]) == OP_JMP_IF ||
+                GET_OPCODE(e->codes[i + 1]) == OP_JMP_IFNOT) &&
+               GET_OPCODE(e->codes[i + 2]) == OP_POP) {
+      // dup; jmp_if(not) L; pop, where L only tests the same value again
+      target = jump_target(e, i + 1);
+      uint8_t op1 = GET_OPCODE(e->codes[i + 1]), op2 = GET_OPCODE(e->codes[target]);
+      if (op2 == OP_JMP_IF || op2 == OP_JMP_IFNOT) {
+        e->codes[i] = op1;
+        set_jump_target(e, i, op1 == op2 ? jump_target(e, target) : target + 1);
+        e->codes[i + 1] = e->codes[i + 2] = MK_OP_A(OP_JMP, 0);
+        changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+static bool constant_truth(env* e, int i, bool* b) {
+  switch (GET_OPCODE(e->codes[i])) {
+    case OP_LOAD_BOOL: *b = e->constants[GET_ARG_A(e->codes[i])].bval; return true;
+    case OP_LOAD_LONG: *b = e->constants[GET_ARG_A(e->codes[i])].lval != 0; return true;
+    case OP_LOAD_DOUBLE: *b = e->constants[GET_ARG_A(e->codes[i])].dval != 0.0; return true;
+    default: return false;
+  }
+}
+
+static bool fold_constant_jumps(env* e) {
+  int i; bool b, changed = false, *targeted = calloc(e->codesidx + 1, sizeof(bool));
+  for (i = 0; i < e->codesidx; ++i)
+    if (is_jump(GET_OPCODE(e->codes[i])))
+      targeted[jump_target(e, i)] = true;
+  for (i = 0; i + 1 < e->codesidx; ++i) {
+    uint8_t op = GET_OPCODE(e->codes[i + 1]);
+    if ((op == OP_JMP_IF || op == OP_JMP_IFNOT) && !targeted[i + 1] && constant_truth(e, i, &b)) {
+      if (b == (op == OP_JMP_IF)) {
+        e->codes[i] = OP_JMP;
+        set_jump_target(e, i, jump_target(e, i + 1));
+      } else {
+        e->codes[i] = MK_OP_A(OP_JMP, 0);
+      }
+      e->codes[i + 1] = MK_OP_A(OP_JMP, 0);
+      changed = true;
+    }
+  }
+  free(targeted);
+  return changed;
+}
+
+static bool remove_dead_codes(env* e) {
+  int i, j, n = e->codesidx, *stack, stackidx = 0;
+  bool *reachable, changed = false;
+  uint32_t *map;
+  reachable = calloc(n, sizeof(bool));
+  map = calloc(n + 1, sizeof(uint32_t));
+  stack = calloc(n, sizeof(int));
+  reachable[0] = true;
+  stack[stackidx++] = 0;
+  while (stackidx > 0) {
+    i = stack[--stackidx];
+    uint8_t op = GET_OPCODE(e->codes[i]);
+    if (falls_through(op) && i + 1 < n && !reachable[i + 1]) {
+      reachable[i + 1] = true;
+      stack[stackidx++] = i + 1;
+    }
+    if (is_jump(op) && !reachable[jump_target(e, i)]) {
+      reachable[jump_target(e, i)] = true;
+      stack[stackidx++] = jump_target(e, i);
+    }
+  }
+  for (i = 0, j = 0; i < n; ++i) {
+    map[i] = j;
+    if (reachable[i] && e->codes[i] != MK_OP_A(OP_JMP, 0))
+      ++j;
+  }
+  map[n] = j;
+  for (i = 0; i < n; ++i) {
+    if (map[i] == map[i + 1])
+      continue;
+    if (is_jump(GET_OPCODE(e->codes[i])))
+      e->codes[i] = (e->codes[i] & ~MK_ARG_A(0xffffffff)) | MK_ARG_A(map[jump_target(e, i)] - map[i] - 1);
+    e->codes[map[i]] = e->codes[i];
+  }
+  changed = map[n] != n;
+  e->codesidx = map[n];
+  free(reachable);
+  free(map);
+  free(stack);
+  return changed;
+}
+
+static void optimize_codes(env* e) {
+  bool changed;
+  do {
+    changed = thread_jumps(e);
+    changed = fold_constant_jumps(e) || changed;
+    changed = remove_dead_codes(e) || changed;
+  } while (changed);
+}
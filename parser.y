@@ -6,7 +6,6 @@
 int yylex();
 int yyerror(state*, char const*);
 #define YYLEX_PARAM s->scanner
-#define cons(a,b) new_cons(s,(a),(b))
 #define uop(op,a) new_uop(s,(op),(a))
 #define binop(op,a,b) new_binop(s,(op),(a),(b))
 %}
@@ -17,11 +16,16 @@ int yyerror(state*, char const*);
 
 %union {
   node *node;
+  char *name;
+  long lval;
+  double dval;
 }
-%token <node> BOOL_LITERAL LONG_LITERAL DOUBLE_LITERAL IDENTIFIER;
+%token <lval> BOOL_LITERAL LONG_LITERAL
+%token <dval> DOUBLE_LITERAL
+%token <name> IDENTIFIER
 %token EQ PLUS MINUS TIMES DIVIDE GT GE EQEQ NEQ LT LE
 %token LPAREN RPAREN COMMA PRINT CR
-%token FUNC RETURN IF ELSEIF ELSE WHILE BREAK CONTINUE END
+%token FUNC RETURN IF ELSEIF ELSE WHILE FOR BREAK CONTINUE END
 %type <node> program statements statement else_opt expression fargs_opt fargs args_opt args primary
 
 %left OR
@@ -42,11 +46,11 @@ program           : sep_opt statements sep_opt
 
 statements        : statements sep statement
                     {
-                      $$ = append($1, cons($3, NULL));
+                      $$ = append_stmt($1, $3);
                     }
                   | statement
                     {
-                      $$ = cons(nint(NODE_STMTS), cons($1, NULL));
+                      $$ = new_stmts(s, $1);
                     }
                   ;
 
@@ -58,37 +62,50 @@ sep_opt           : sep
                   |
                   ;
 
-statement         : FUNC IDENTIFIER LPAREN fargs_opt RPAREN sep statements sep END
+statement         : FUNC IDENTIFIER
                     {
-                      $$ = cons(nint(NODE_FUNCTION), cons($2, cons($4, $7)));
+                      $<lval>$ = s->line;
+                    }
+                    LPAREN fargs_opt RPAREN sep statements sep END
+                    {
+                      $$ = new_function(s, $2, $5, $8);
+                      $$->line = $<lval>3;
                     }
                   | RETURN expression
                     {
-                      $$ = cons(nint(NODE_RETURN), $2);
+                      $$ = new_return(s, $2);
                     }
                   | IDENTIFIER EQ expression
                     {
-                      $$ = cons(nint(NODE_ASSIGN), cons($1, $3));
+                      $$ = new_assign(s, $1, $3);
                     }
                   | IF expression sep statements sep else_opt END
                     {
-                      $$ = cons(nint(NODE_IF), cons($2, cons($4, $6)));
+                      $$ = new_if(s, $2, $4, $6);
                     }
                   | WHILE expression sep statements sep END
                     {
-                      $$ = cons(nint(NODE_WHILE), cons($2, $4));
+                      $$ = new_while(s, $2, $4);
+                    }
+                  | FOR IDENTIFIER EQ expression COMMA expression sep statements sep END
+                    {
+                      $$ = new_for(s, $2, $4, $6, NULL, $8);
+                    }
+                  | FOR IDENTIFIER EQ expression COMMA expression COMMA expression sep statements sep END
+                    {
+                      $$ = new_for(s, $2, $4, $6, $8, $10);
                     }
                   | BREAK
                     {
-                      $$ = cons(nint(NODE_BREAK), NULL);
+                      $$ = new_leaf(s, NODE_BREAK);
                     }
                   | CONTINUE
                     {
-                      $$ = cons(nint(NODE_CONTINUE), NULL);
+                      $$ = new_leaf(s, NODE_CONTINUE);
                     }
                   | PRINT expression
                     {
-                      $$ = cons(nint(NODE_PRINT), $2);
+                      $$ = new_print(s, $2);
                     }
                   ;
 
@@ -98,7 +115,7 @@ else_opt          :
                     }
                   | ELSEIF expression sep statements sep else_opt
                     {
-                      $$ = cons(nint(NODE_IF), cons($2, cons($4, $6)));
+                      $$ = new_if(s, $2, $4, $6);
                     }
                   | ELSE sep statements sep
                     {
@@ -108,7 +125,7 @@ else_opt          :
 
 expression        : IDENTIFIER LPAREN args_opt RPAREN
                     {
-                      $$ = cons(nint(NODE_FCALL), cons($1, $3));
+                      $$ = new_fcall(s, $1, $3);
                     }
                   | NOT expression
                     {
@@ -192,11 +209,11 @@ fargs_opt         :
 
 fargs             : IDENTIFIER
                     {
-                      $$ = cons($1, NULL);
+                      $$ = new_identifier(s, $1);
                     }
                   | fargs COMMA IDENTIFIER
                     {
-                      $$ = append($1, cons($3, NULL));
+                      $$ = append($1, new_identifier(s, $3));
                     }
                   ;
 
@@ -212,29 +229,29 @@ args_opt          :
 
 args              : expression
                     {
-                      $$ = cons($1, NULL);
+                      $$ = $1;
                     }
                   | args COMMA expression
                     {
-                      $$ = append($1, cons($3, NULL));
+                      $$ = append($1, $3);
                     }
                   ;
 
 primary           : BOOL_LITERAL
                     {
-                      $$ = cons(nint(NODE_BOOL), $1);
+                      $$ = new_bool(s, $1);
                     }
                   | LONG_LITERAL
                     {
-                      $$ = cons(nint(NODE_LONG), $1);
+                      $$ = new_long(s, $1);
                     }
                   | DOUBLE_LITERAL
                     {
-                      $$ = cons(nint(NODE_DOUBLE), $1);
+                      $$ = new_double(s, $1);
                     }
                   | IDENTIFIER
                     {
-                      $$ = cons(nint(NODE_IDENTIFIER), $1);
+                      $$ = new_identifier(s, $1);
                     }
                   ;
 
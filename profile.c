@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "opcode.h"
+#include "vm.h"
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+// The number of times each instruction ran and, unless ticks is NULL, the time
+// spent in it, in cycles where rdtsc is available and in nanoseconds otherwise.
+// The peak stack and frame depths are for --stats.
+typedef struct profile {
+  uint64_t* counts;
+  uint64_t* ticks;
+  uint32_t max_stack;
+  uint32_t max_frames;
+} profile;
+
+#ifdef __x86_64__
+#define TICKS_UNIT "cycles"
+#else
+#define TICKS_UNIT "ns"
+#endif
+
+static inline uint64_t read_ticks(void) {
+#ifdef __x86_64__
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// Each dispatch charges the time since the previous one to the previous instruction.
+#define PROFILE_LOCALS uint64_t last_ticks = read_ticks(), now; int last_pc = 0
+#define PROFILE_STEP() \
+  do { \
+    p->counts[i]++; \
+    if (sp - e->stack > p->max_stack) \
+      p->max_stack = sp - e->stack; \
+    if (e->framesidx > p->max_frames) \
+      p->max_frames = e->framesidx; \
+    if (p->ticks != NULL) { \
+      now = read_ticks(); \
+      p->ticks[last_pc] += now - last_ticks; \
+      last_ticks = now; \
+      last_pc = i; \
+    } \
+  } while (0)
+
+#define PROFILE
+#include "vm.c"
+#undef PROFILE
+#undef DISPATCH_HOOK
+#define DISPATCH_HOOK()
+
+typedef struct profile_entry {
+  int pc;
+  uint64_t count;
+  uint64_t ticks;
+  uint64_t calls;
+} profile_entry;
+
+static int compare_ticks(const void* a, const void* b) {
+  const profile_entry* x = a, *y = b;
+  return x->ticks < y->ticks ? 1 : x->ticks > y->ticks ? -1 : x->pc - y->pc;
+}
+
+static int compare_count(const void* a, const void* b) {
+  const profile_entry* x = a, *y = b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : x->pc - y->pc;
+}
+
+// The instruction as print_codes shows it, or only its name.
+static char* format_code(env* e, int pc, char* buf, size_t len, bool name_only) {
+  FILE* fp = fmemopen(buf, len, "w");
+  print_code(fp, e, pc);
+  fclose(fp);
+  buf[strcspn(buf, name_only ? " \n" : "\n")] = '\0';
+  return buf;
+}
+
+static void print_profile(env* e, profile* p) {
+  int i, j, n;
+  char buf[64];
+  uint64_t count = 0, ticks = 0;
+  bool timed = p->ticks != NULL;
+  int (*compare)(const void*, const void*) = timed ? compare_ticks : compare_count;
+  profile_entry* entries = calloc(e->codesidx > 256 ? e->codesidx : 256, sizeof(profile_entry));
+  for (i = 0; i < e->codesidx; ++i) {
+    count += p->counts[i];
+    ticks += timed ? p->ticks[i] : 0;
+  }
+  fprintf(stderr, "%llu instructions", (unsigned long long)count);
+  if (timed)
+    fprintf(stderr, ", %llu %s", (unsigned long long)ticks, TICKS_UNIT);
+  fprintf(stderr, "\n");
+
+  // Opcodes are as they are at exit, after quickening.
+  for (i = 0; i < 256; ++i)
+    entries[i].pc = -1;
+  for (i = 0; i < e->codesidx; ++i) {
+    profile_entry* o = &entries[GET_OPCODE(e->codes[i])];
+    if (o->pc < 0)
+      o->pc = i;
+    o->count += p->counts[i];
+    o->ticks += timed ? p->ticks[i] : 0;
+  }
+  qsort(entries, 256, sizeof(profile_entry), compare);
+  fprintf(stderr, "\n%-20s %12s %7s", "opcode", "count", "%");
+  if (timed)
+    fprintf(stderr, " %14s %10s", TICKS_UNIT, "per op");
+  fprintf(stderr, "\n");
+  for (i = 0; i < 256 && entries[i].count > 0; ++i) {
+    fprintf(stderr, "%-20s %12llu %6.2f%%", format_code(e, entries[i].pc, buf, sizeof(buf), true),
+        (unsigned long long)entries[i].count, 100.0 * entries[i].count / count);
+    if (timed)
+      fprintf(stderr, " %14llu %10.1f", (unsigned long long)entries[i].ticks,
+          (double)entries[i].ticks / entries[i].count);
+    fprintf(stderr, "\n");
+  }
+
+  for (i = 0; i < e->codesidx; ++i)
+    entries[i] = (profile_entry){ i, p->counts[i], timed ? p->ticks[i] : 0, 0 };
+  qsort(entries, e->codesidx, sizeof(profile_entry), compare);
+  fprintf(stderr, "\n%6s %12s %7s", "pc", "count", "%");
+  if (timed)
+    fprintf(stderr, " %14s", TICKS_UNIT);
+  fprintf(stderr, "  instruction\n");
+  for (i = 0; i < 20 && i < e->codesidx && entries[i].count > 0; ++i) {
+    fprintf(stderr, "%6d %12llu %6.2f%%", entries[i].pc,
+        (unsigned long long)entries[i].count, 100.0 * entries[i].count / count);
+    if (timed)
+      fprintf(stderr, " %14llu", (unsigned long long)entries[i].ticks);
+    fprintf(stderr, "  %s\n", format_code(e, entries[i].pc, buf, sizeof(buf), false));
+  }
+
+  // A function is loaded by func and stored by let. Its body starts with enter,
+  // which runs once per call, and ends where the preceding jmp skips to.
+  for (i = n = 0; i < e->codesidx; ++i) {
+    if (GET_OPCODE(e->codes[i]) != OP_LOAD_FUNC)
+      continue;
+    int start = i + GET_ARG_A(e->codes[i]) + 1, end = start;
+    if (GET_OPCODE(e->codes[start - 1]) == OP_JMP)
+      end = start + GET_ARG_A(e->codes[start - 1]);
+    profile_entry* f = &entries[n++];
+    *f = (profile_entry){ i, 0, 0, p->counts[start] };
+    for (j = start; j < end && j < e->codesidx; ++j) {
+      f->count += p->counts[j];
+      f->ticks += timed ? p->ticks[j] : 0;
+    }
+  }
+  qsort(entries, n, sizeof(profile_entry), compare);
+  if (n > 0) {
+    fprintf(stderr, "\n%-20s %12s %14s %7s", "function", "calls", "instructions", "%");
+    if (timed)
+      fprintf(stderr, " %14s", TICKS_UNIT);
+    fprintf(stderr, "\n");
+  }
+  for (i = 0; i < n; ++i) {
+    uint64_t code = e->codes[entries[i].pc + 1];
+    char* name = NULL;
+    if (GET_OPCODE(code) == OP_LET)
+      name = e->variables[GET_ARG_A(code)].name;
+    if (name == NULL)
+      snprintf(name = buf, sizeof(buf), "func@%d", entries[i].pc + GET_ARG_A(e->codes[entries[i].pc]) + 1);
+    fprintf(stderr, "%-20s %12llu %14llu %6.2f%%", name, (unsigned long long)entries[i].calls,
+        (unsigned long long)entries[i].count, 100.0 * entries[i].count / count);
+    if (timed)
+      fprintf(stderr, " %14llu", (unsigned long long)entries[i].ticks);
+    fprintf(stderr, "\n");
+  }
+  free(entries);
+}
+
+// Prints the report for --profile (with cycles when prof > 1) and fills in
+// the totals for --stats.
+static void execute_profile(env* e, int prof, stats* st) {
+  int i;
+  profile p = { calloc(e->codesidx, sizeof(uint64_t)), NULL, 0, 0 };
+  if (prof > 1)
+    p.ticks = calloc(e->codesidx, sizeof(uint64_t));
+  execute_codes_profile(e, &p);
+  fflush(stdout);
+  if (prof)
+    print_profile(e, &p);
+  if (st != NULL) {
+    st->instructions = 0;
+    for (i = 0; i < e->codesidx; ++i)
+      st->instructions += p.counts[i];
+    st->max_stack = p.max_stack;
+    st->max_frames = p.max_frames;
+  }
+  free(p.counts);
+  free(p.ticks);
+}
@@ -0,0 +1,679 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "node.h"
+#include "opcode.h"
+#include "vm.h"
+#include "y.tab.h"
+
+/*
+ * A register machine next to the stack machine. Instructions name their
+ * operands directly: a global, a constant or a register of the current frame,
+ * which holds the locals of the function followed by its temporaries. During
+ * code generation the top two bits of an operand tell these kinds apart.
+ * Linking places the constants right after the globals, so that at run time
+ * the top bit alone selects between absolute and frame relative registers.
+ */
+
+#define REG_GLOBAL          0x0000
+#define REG_CONSTANT        0x4000
+#define REG_LOCAL           0x8000
+#define REG_TEMP            0xc000
+#define REG_KIND(x)         ((x) & 0xc000)
+#define REG_INDEX(x)        ((x) & 0x3fff)
+
+typedef struct reg_code {
+  uint16_t op;
+  uint16_t a;
+  uint16_t b;
+  uint16_t c;
+} reg_code;
+
+typedef struct reg_program {
+  uint16_t codesidx;
+  uint32_t codeslen;
+  reg_code* codes;
+  uint16_t constantsidx;
+  uint16_t constantslen;
+  value* constants;
+  uint16_t globals;
+  uint16_t temps;
+  uint16_t maxtemps;
+  uint16_t while_pc;
+} reg_program;
+
+// The arguments of each instruction: r for an operand, n for a pc or a count.
+static const struct {
+  const char* name;
+  const char* args;
+} reg_opcodes[] = {
+  [ROP_MOVE] = {"move", "rr"},
+  [ROP_LOAD_FUNC] = {"func", "rn"},
+  [ROP_JMP] = {"jmp", "n"},
+  [ROP_JMP_IF] = {"jmp_if", "nr"},
+  [ROP_JMP_IFNOT] = {"jmp_ifnot", "nr"},
+  [ROP_JMP_IFNOT_GT] = {"jmp_ifnot_>", "nrr"},
+  [ROP_JMP_IFNOT_GE] = {"jmp_ifnot_>=", "nrr"},
+  [ROP_JMP_IFNOT_EQEQ] = {"jmp_ifnot_==", "nrr"},
+  [ROP_JMP_IFNOT_NEQ] = {"jmp_ifnot_!=", "nrr"},
+  [ROP_JMP_IFNOT_LT] = {"jmp_ifnot_<", "nrr"},
+  [ROP_JMP_IFNOT_LE] = {"jmp_ifnot_<=", "nrr"},
+  [ROP_FORPREP] = {"forprep", "nrr"},
+  [ROP_FORLOOP] = {"forloop", "nrr"},
+  [ROP_CALL] = {"call", "rrn"},
+  [ROP_TAILCALL] = {"tailcall", "rrn"},
+  [ROP_FCALL] = {"fcall", "rnn"},
+  [ROP_ENTER] = {"enter", "nn"},
+  [ROP_RETURN] = {"return", "r"},
+  [ROP_PRINT] = {"print", "r"},
+  [ROP_UNOT] = {"!", "rr"},
+  [ROP_UADD] = {"+", "rr"},
+  [ROP_UMINUS] = {"-", "rr"},
+  [ROP_ADD] = {"+", "rrr"},
+  [ROP_MINUS] = {"-", "rrr"},
+  [ROP_TIMES] = {"*", "rrr"},
+  [ROP_DIVIDE] = {"/", "rrr"},
+  [ROP_GT] = {">", "rrr"},
+  [ROP_GE] = {">=", "rrr"},
+  [ROP_EQEQ] = {"==", "rrr"},
+  [ROP_NEQ] = {"!=", "rrr"},
+  [ROP_LT] = {"<", "rrr"},
+  [ROP_LE] = {"<=", "rrr"},
+  [ROP_HALT] = {"halt", ""},
+};
+
+static uint16_t* reg_arg(reg_code* c, int k) {
+  return k == 0 ? &c->a : k == 1 ? &c->b : &c->c;
+}
+
+static uint16_t reg_addcode(reg_program* p, int op, int a, int b, int c) {
+  if (p->codesidx == UINT16_MAX) {
+    printf("Too many instructions\n");
+    exit(1);
+  }
+  if (p->codesidx == p->codeslen) {
+    p->codeslen *= 2;
+    p->codes = realloc(p->codes, p->codeslen * sizeof(reg_code));
+  }
+  p->codes[p->codesidx].op = op;
+  p->codes[p->codesidx].a = a;
+  p->codes[p->codesidx].b = b;
+  p->codes[p->codesidx].c = c;
+  return p->codesidx++;
+}
+
+static int reg_index(int index) {
+  if (index > REG_INDEX(0xffff)) {
+    printf("Too many registers\n");
+    exit(1);
+  }
+  return index;
+}
+
+static bool same_value(value v, value w) {
+  if (VAL_TYPE(v) != VAL_TYPE(w))
+    return false;
+  switch (VAL_TYPE(v)) {
+    case VT_BOOL: return AS_BOOL(v) == AS_BOOL(w);
+    case VT_LONG: return AS_LONG(v) == AS_LONG(w);
+    default: {
+      double d = AS_DOUBLE(v), g = AS_DOUBLE(w);
+      return !memcmp(&d, &g, sizeof(double));
+    }
+  }
+}
+
+static int reg_constant(reg_program* p, value v) {
+  int i;
+  for (i = 0; i < p->constantsidx; ++i)
+    if (same_value(p->constants[i], v))
+      return REG_CONSTANT | i;
+  if (p->constantsidx == p->constantslen) {
+    p->constantslen *= 2;
+    p->constants = realloc(p->constants, p->constantslen * sizeof(value));
+  }
+  p->constants[p->constantsidx] = v;
+  return REG_CONSTANT | reg_index(p->constantsidx++);
+}
+
+static int reg_temp(reg_program* p) {
+  if (p->temps == p->maxtemps)
+    ++p->maxtemps;
+  return REG_TEMP | reg_index(p->temps++);
+}
+
+static int reg_variable(variable_index vi) {
+  return (vi.global ? REG_GLOBAL : REG_LOCAL) | reg_index(vi.index);
+}
+
+static bool has_call(node* n) {
+  switch (n->type) {
+    case NODE_FCALL: return true;
+    case NODE_UNARYOP: return has_call(n->expr);
+    case NODE_BINOP: return has_call(n->lhs) || has_call(n->rhs);
+    default: return false;
+  }
+}
+
+static void reg_expr(env*, reg_program*, node*, int);
+
+// Identifiers and constants are used in place; anything else is computed
+// into a new temporary.
+static int reg_operand(env* e, reg_program* p, node* n) {
+  int t;
+  variable_index vi;
+  switch (n->type) {
+    case NODE_BOOL: return reg_constant(p, BOOL_VAL(n->bval));
+    case NODE_LONG: return reg_constant(p, LONG_VAL(n->lval));
+    case NODE_DOUBLE: return reg_constant(p, DOUBLE_VAL(n->dval));
+    case NODE_IDENTIFIER:
+      vi = lookup(e, n->name, false);
+      if (vi.index < 0) {
+        printf("Unknown variable: %s\n", n->name);
+        exit(1);
+      }
+      return reg_variable(vi);
+    default:
+      t = reg_temp(p);
+      reg_expr(e, p, n, t);
+      return t;
+  }
+}
+
+// A global on the left may be reassigned by a call on the right, so it is
+// copied first just as the stack machine would have loaded it.
+static void reg_operands(env* e, reg_program* p, node* lhs, node* rhs, int* a, int* b) {
+  int t;
+  *a = reg_operand(e, p, lhs);
+  if (REG_KIND(*a) == REG_GLOBAL && has_call(rhs)) {
+    t = reg_temp(p);
+    reg_addcode(p, ROP_MOVE, t, *a, 0);
+    *a = t;
+  }
+  *b = reg_operand(e, p, rhs);
+}
+
+// The arguments go to consecutive temporaries, the first of which becomes the
+// base of the callee frame and receives the result.
+static void reg_call(env* e, reg_program* p, node* n, int op, int dst) {
+  int i, f, argc = 0, base;
+  node* m;
+  variable_index vi;
+  for (m = n->args; m != NULL; m = m->next)
+    ++argc;
+  vi = lookup(e, n->name, false);
+  if (vi.index >= 0) {
+    f = reg_variable(vi);
+  } else {
+    op = ROP_FCALL;
+    for (f = 0; f < sizeof(gfuncs) / sizeof(func); ++f) {
+      if (gfuncs[f].name == n->name)
+        break;
+    }
+    if (f == sizeof(gfuncs) / sizeof(func)) {
+      printf("Unknown function: %s\n", n->name);
+      exit(1);
+    }
+  }
+  if (REG_KIND(dst) == REG_TEMP && REG_INDEX(dst) == p->temps - 1)
+    base = dst;
+  else
+    base = reg_temp(p);
+  for (i = 1; i < argc; ++i)
+    reg_temp(p);
+  for (i = 0, m = n->args; m != NULL; m = m->next, ++i)
+    reg_expr(e, p, m, base + i);
+  reg_addcode(p, op, base, f, argc);
+  if (op != ROP_TAILCALL && dst != base)
+    reg_addcode(p, ROP_MOVE, dst, base, 0);
+}
+
+static void reg_expr(env* e, reg_program* p, node* n, int dst) {
+  int a, b, op;
+  uint16_t index;
+  switch (n->type) {
+    case NODE_FCALL:
+      reg_call(e, p, n, ROP_CALL, dst);
+      break;
+    case NODE_UNARYOP:
+      a = reg_operand(e, p, n->expr);
+      switch (n->op) {
+        case NOT: op = ROP_UNOT; break;
+        case PLUS: op = ROP_UADD; break;
+        case MINUS: op = ROP_UMINUS; break;
+        default: printf("Unknown unary operator\n"); exit(1);
+      }
+      reg_addcode(p, op, dst, a, 0);
+      break;
+    case NODE_BINOP:
+      if (n->op == AND || n->op == OR) {
+        if (REG_KIND(dst) != REG_TEMP) {
+          a = reg_temp(p);
+          reg_expr(e, p, n, a);
+          reg_addcode(p, ROP_MOVE, dst, a, 0);
+          break;
+        }
+        reg_expr(e, p, n->lhs, dst);
+        index = reg_addcode(p, n->op == AND ? ROP_JMP_IFNOT : ROP_JMP_IF, 0, dst, 0);
+        reg_expr(e, p, n->rhs, dst);
+        p->codes[index].a = p->codesidx;
+        break;
+      }
+      reg_operands(e, p, n->lhs, n->rhs, &a, &b);
+      switch (n->op) {
+        case PLUS: op = ROP_ADD; break;
+        case MINUS: op = ROP_MINUS; break;
+        case TIMES: op = ROP_TIMES; break;
+        case DIVIDE: op = ROP_DIVIDE; break;
+        case GT: op = ROP_GT; break;
+        case GE: op = ROP_GE; break;
+        case EQEQ: op = ROP_EQEQ; break;
+        case NEQ: op = ROP_NEQ; break;
+        case LT: op = ROP_LT; break;
+        case LE: op = ROP_LE; break;
+        default: printf("Unknown binary operator\n"); exit(1);
+      }
+      reg_addcode(p, op, dst, a, b);
+      break;
+    default:
+      reg_addcode(p, ROP_MOVE, dst, reg_operand(e, p, n), 0);
+      break;
+  }
+}
+
+static uint16_t reg_jmp_ifnot(env* e, reg_program* p, node* n) {
+  int a, b, op = ROP_JMP_IFNOT;
+  if (n->type == NODE_BINOP) {
+    switch (n->op) {
+      case GT: op = ROP_JMP_IFNOT_GT; break;
+      case GE: op = ROP_JMP_IFNOT_GE; break;
+      case EQEQ: op = ROP_JMP_IFNOT_EQEQ; break;
+      case NEQ: op = ROP_JMP_IFNOT_NEQ; break;
+      case LT: op = ROP_JMP_IFNOT_LT; break;
+      case LE: op = ROP_JMP_IFNOT_LE; break;
+    }
+    if (op != ROP_JMP_IFNOT) {
+      reg_operands(e, p, n->lhs, n->rhs, &a, &b);
+      return reg_addcode(p, op, 0, a, b);
+    }
+  }
+  return reg_addcode(p, ROP_JMP_IFNOT, 0, reg_operand(e, p, n), 0);
+}
+
+// Temporaries follow the locals, whose number is only known at the end.
+static void reg_link_temps(reg_program* p, uint16_t start, int locals) {
+  int i, k;
+  uint16_t* x;
+  for (i = start; i < p->codesidx; ++i) {
+    for (k = 0; reg_opcodes[p->codes[i].op].args[k]; ++k) {
+      x = reg_arg(&p->codes[i], k);
+      if (reg_opcodes[p->codes[i].op].args[k] == 'r' && REG_KIND(*x) == REG_TEMP)
+        *x = REG_LOCAL | reg_index(REG_INDEX(*x) + locals);
+    }
+  }
+}
+
+static void reg_stmt(env* e, reg_program* p, node* n) {
+  uint16_t temps = p->temps, index0, index1;
+  switch (n->type) {
+    case NODE_FUNCTION: {
+      variable_index vi = lookup(e, n->name, true);
+      uint16_t maxtemps = p->maxtemps; int params;
+      reg_addcode(p, ROP_LOAD_FUNC, reg_variable(vi), p->codesidx + 2, 0);
+      index0 = reg_addcode(p, ROP_JMP, 0, 0, 0);
+      index1 = reg_addcode(p, ROP_ENTER, 0, 0, 0);
+      new_local_variables(e);
+      params = declare_args(e, n->params);
+      p->temps = p->maxtemps = 0;
+      reg_stmt(e, p, n->body);
+      reg_addcode(p, ROP_RETURN, reg_constant(p, LONG_VAL(0)), 0, 0);
+      p->codes[index0].a = p->codesidx;
+      p->codes[index1].a = e->local_variables_len + p->maxtemps;
+      p->codes[index1].b = params;
+      reg_link_temps(p, index1, e->local_variables_len);
+      free(e->local_variables);
+      e->local_variables = NULL;
+      e->local_variables_len = 0;
+      p->maxtemps = maxtemps;
+      break;
+    }
+    case NODE_RETURN:
+      if (e->local_variables == NULL) {
+        printf("return outside of function\n");
+        exit(1);
+      }
+      if (n->expr->type == NODE_FCALL && lookup(e, n->expr->name, false).index >= 0) {
+        reg_call(e, p, n->expr, ROP_TAILCALL, 0);
+        break;
+      }
+      reg_addcode(p, ROP_RETURN, reg_operand(e, p, n->expr), 0, 0);
+      break;
+    case NODE_STMTS:
+      for (n = n->stmts; n != NULL; n = n->next)
+        reg_stmt(e, p, n);
+      break;
+    case NODE_ASSIGN: {
+      variable_index vi = lookup(e, n->name, true);
+      reg_expr(e, p, n->expr, reg_variable(vi));
+      break;
+    }
+    case NODE_IF:
+      index0 = reg_jmp_ifnot(e, p, n->cond);
+      p->temps = temps;
+      reg_stmt(e, p, n->body);
+      if (n->orelse != NULL) {
+        index1 = reg_addcode(p, ROP_JMP, 0, 0, 0);
+        p->codes[index0].a = p->codesidx;
+        reg_stmt(e, p, n->orelse);
+        p->codes[index1].a = p->codesidx;
+      } else {
+        p->codes[index0].a = p->codesidx;
+      }
+      break;
+    case NODE_WHILE: {
+      uint16_t save_while_pc = p->while_pc; p->while_pc = p->codesidx;
+      reg_addcode(p, ROP_JMP, p->codesidx + 2, 0, 0);
+      index0 = reg_addcode(p, ROP_JMP, 0, 0, 0);
+      index1 = reg_jmp_ifnot(e, p, n->cond);
+      p->temps = temps;
+      reg_stmt(e, p, n->body);
+      reg_addcode(p, ROP_JMP, p->while_pc + 2, 0, 0);
+      p->codes[index0].a = p->codes[index1].a = p->codesidx;
+      p->while_pc = save_while_pc;
+      break;
+    }
+    case NODE_FOR: {
+      // The limit and the step go to two consecutive temporaries that live
+      // through the loop; forprep and forloop name the first one. As on the
+      // stack machine, they are evaluated before the start is assigned.
+      variable_index vi = lookup(e, n->name, true);
+      uint16_t save_while_pc = p->while_pc, index2;
+      int limit;
+      limit = reg_temp(p);
+      reg_temp(p);
+      reg_expr(e, p, n->args->next, limit);
+      if (n->args->next->next != NULL)
+        reg_expr(e, p, n->args->next->next, limit + 1);
+      else
+        reg_addcode(p, ROP_MOVE, limit + 1, reg_constant(p, LONG_VAL(1)), 0);
+      reg_expr(e, p, n->args, reg_variable(vi));
+      p->while_pc = reg_addcode(p, ROP_JMP, p->codesidx + 3, 0, 0);
+      index0 = reg_addcode(p, ROP_JMP, 0, 0, 0);
+      index1 = reg_addcode(p, ROP_JMP, 0, 0, 0);
+      index2 = reg_addcode(p, ROP_FORPREP, 0, reg_variable(vi), limit);
+      reg_stmt(e, p, n->body);
+      p->codes[index1].a = reg_addcode(p, ROP_FORLOOP, index2 + 1, reg_variable(vi), limit);
+      p->codes[index0].a = p->codes[index2].a = p->codesidx;
+      p->while_pc = save_while_pc;
+      break;
+    }
+    case NODE_BREAK:
+      reg_addcode(p, ROP_JMP, p->while_pc + 1, 0, 0);
+      break;
+    case NODE_CONTINUE:
+      reg_addcode(p, ROP_JMP, p->while_pc + 2, 0, 0);
+      break;
+    case NODE_PRINT:
+      reg_addcode(p, ROP_PRINT, reg_operand(e, p, n->expr), 0, 0);
+      break;
+    default:
+      printf("Unknown node %d\n", n->type);
+      exit(1);
+  }
+  p->temps = temps;
+}
+
+static reg_program* reg_codegen(env* e, node* n) {
+  int i, k;
+  uint16_t* x;
+  reg_program* p = malloc(sizeof(reg_program));
+  p->codesidx = 0;
+  p->codeslen = 1024;
+  p->codes = malloc(p->codeslen * sizeof(reg_code));
+  p->constantsidx = 0;
+  p->constantslen = 128;
+  p->constants = malloc(p->constantslen * sizeof(value));
+  p->temps = p->maxtemps = 0;
+  p->while_pc = 0;
+  reg_stmt(e, p, n);
+  reg_addcode(p, ROP_HALT, 0, 0, 0);
+  reg_link_temps(p, 0, 0);
+  p->globals = e->variableslen;
+  for (i = 0; i < p->codesidx; ++i) {
+    for (k = 0; reg_opcodes[p->codes[i].op].args[k]; ++k) {
+      x = reg_arg(&p->codes[i], k);
+      if (reg_opcodes[p->codes[i].op].args[k] == 'r' && REG_KIND(*x) == REG_CONSTANT)
+        *x = reg_index(p->globals + REG_INDEX(*x));
+    }
+  }
+  return p;
+}
+
+static void free_reg_program(reg_program* p) {
+  free(p->codes);
+  free(p->constants);
+  free(p);
+}
+
+static void print_reg_codes(reg_program* p) {
+  int i, k;
+  uint16_t x;
+  for (i = 0; i < p->codesidx; ++i) {
+    printf("%s", reg_opcodes[p->codes[i].op].name);
+    for (k = 0; reg_opcodes[p->codes[i].op].args[k]; ++k) {
+      x = *reg_arg(&p->codes[i], k);
+      if (reg_opcodes[p->codes[i].op].args[k] == 'n')
+        printf(" %d", x);
+      else if (x & REG_LOCAL)
+        printf(" r%d", REG_INDEX(x));
+      else if (x < p->globals)
+        printf(" g%d", x);
+      else
+        printf(" k%d", x - p->globals);
+    }
+    printf("\n");
+  }
+}
+
+#define REG(x)              r[((x) & 0x7fff) + (base & -(uint32_t)((x) >> 15))]
+#define RA                  REG(p->codes[i].a)
+#define RB                  REG(p->codes[i].b)
+#define RC                  REG(p->codes[i].c)
+
+#ifdef USE_COMPUTED_GOTO
+#define REG_NEXT()          goto *dispatch_table[p->codes[++i].op]
+#define REG_JUMP(pc)        goto *dispatch_table[p->codes[i = (pc)].op]
+#else
+#define REG_NEXT()          do { ++i; goto dispatch; } while (0)
+#define REG_JUMP(pc)        do { i = (pc); goto dispatch; } while (0)
+#endif
+
+#define REG_BINARY_OP(op) \
+  do { \
+    value lhs = RB, rhs = RC; \
+    if (IS_LONG(lhs) && IS_LONG(rhs)) \
+      RA = LONG_VAL(AS_LONG(lhs) op AS_LONG(rhs)); \
+    else if (IS_DOUBLE(lhs) || IS_DOUBLE(rhs)) \
+      RA = DOUBLE_VAL(TO_DOUBLE(lhs) op TO_DOUBLE(rhs)); \
+    else \
+      RA = LONG_VAL(TO_LONG(lhs) op TO_LONG(rhs)); \
+  } while (0)
+
+#define REG_COMPARE(lhs, op, rhs) \
+  (IS_LONG(lhs) && IS_LONG(rhs) ? AS_LONG(lhs) op AS_LONG(rhs) : \
+   IS_DOUBLE(lhs) || IS_DOUBLE(rhs) ? TO_DOUBLE(lhs) op TO_DOUBLE(rhs) : \
+   TO_LONG(lhs) op TO_LONG(rhs))
+
+#define REG_LOGICAL_BINARY_OP(op) \
+  do { \
+    value lhs = RB, rhs = RC; \
+    RA = BOOL_VAL(REG_COMPARE(lhs, op, rhs)); \
+  } while (0)
+
+#define REG_JMP_IFNOT_BINARY_OP(op) \
+  do { \
+    value lhs = RB, rhs = RC; \
+    if (!REG_COMPARE(lhs, op, rhs)) \
+      REG_JUMP(p->codes[i].a); \
+  } while (0)
+
+#define REG_UNARY_OP(op) \
+  do { \
+    value v = RB; \
+    RA = IS_DOUBLE(v) ? DOUBLE_VAL(op(AS_DOUBLE(v))) : LONG_VAL(op(TO_LONG(v))); \
+  } while (0)
+
+// Function values are the pcs of their enter instructions.
+static inline void reg_check_function(reg_program* p, value v) {
+  if (!IS_LONG(v) || AS_LONG(v) < 0 || AS_LONG(v) >= p->codesidx || p->codes[AS_LONG(v)].op != ROP_ENTER)
+    not_a_function();
+}
+
+static value* reserve_registers(value* r, uint32_t* cap, uint32_t n) {
+  if (n <= *cap)
+    return r;
+  while (*cap < n)
+    *cap *= 2;
+  return realloc(r, *cap * sizeof(value));
+}
+
+static void execute_registers(env* e, reg_program* p) {
+  uint32_t i = 0, j, k, base, cap = 1024;
+  value *r, v;
+  frame* f;
+#ifdef USE_COMPUTED_GOTO
+  static void* dispatch_table[] = {
+    [ROP_MOVE] = &&L_ROP_MOVE,
+    [ROP_LOAD_FUNC] = &&L_ROP_LOAD_FUNC,
+    [ROP_JMP] = &&L_ROP_JMP,
+    [ROP_JMP_IF] = &&L_ROP_JMP_IF,
+    [ROP_JMP_IFNOT] = &&L_ROP_JMP_IFNOT,
+    [ROP_JMP_IFNOT_GT] = &&L_ROP_JMP_IFNOT_GT,
+    [ROP_JMP_IFNOT_GE] = &&L_ROP_JMP_IFNOT_GE,
+    [ROP_JMP_IFNOT_EQEQ] = &&L_ROP_JMP_IFNOT_EQEQ,
+    [ROP_JMP_IFNOT_NEQ] = &&L_ROP_JMP_IFNOT_NEQ,
+    [ROP_JMP_IFNOT_LT] = &&L_ROP_JMP_IFNOT_LT,
+    [ROP_JMP_IFNOT_LE] = &&L_ROP_JMP_IFNOT_LE,
+    [ROP_FORPREP] = &&L_ROP_FORPREP,
+    [ROP_FORLOOP] = &&L_ROP_FORLOOP,
+    [ROP_CALL] = &&L_ROP_CALL,
+    [ROP_TAILCALL] = &&L_ROP_TAILCALL,
+    [ROP_FCALL] = &&L_ROP_FCALL,
+    [ROP_ENTER] = &&L_ROP_ENTER,
+    [ROP_RETURN] = &&L_ROP_RETURN,
+    [ROP_PRINT] = &&L_ROP_PRINT,
+    [ROP_UNOT] = &&L_ROP_UNOT,
+    [ROP_UADD] = &&L_ROP_UADD,
+    [ROP_UMINUS] = &&L_ROP_UMINUS,
+    [ROP_ADD] = &&L_ROP_ADD,
+    [ROP_MINUS] = &&L_ROP_MINUS,
+    [ROP_TIMES] = &&L_ROP_TIMES,
+    [ROP_DIVIDE] = &&L_ROP_DIVIDE,
+    [ROP_GT] = &&L_ROP_GT,
+    [ROP_GE] = &&L_ROP_GE,
+    [ROP_EQEQ] = &&L_ROP_EQEQ,
+    [ROP_NEQ] = &&L_ROP_NEQ,
+    [ROP_LT] = &&L_ROP_LT,
+    [ROP_LE] = &&L_ROP_LE,
+    [ROP_HALT] = &&L_ROP_HALT,
+  };
+#endif
+  e->stack = calloc(1024, sizeof(value));
+  init_frames(e);
+  base = e->frames[0].base = e->frames[0].top = p->globals + p->constantsidx;
+  r = reserve_registers(malloc(cap * sizeof(value)), &cap, base + p->maxtemps);
+  for (j = 0; j < p->globals; ++j)
+    r[j] = BOOL_VAL(false);
+  memcpy(r + p->globals, p->constants, p->constantsidx * sizeof(value));
+  SWITCH(p->codes[i].op) {
+    CASE(ROP_MOVE): RA = RB; REG_NEXT();
+    CASE(ROP_LOAD_FUNC): RA = LONG_VAL(p->codes[i].b); REG_NEXT();
+    CASE(ROP_JMP): REG_JUMP(p->codes[i].a);
+    CASE(ROP_JMP_IF):
+      if (TO_BOOL(RB))
+        REG_JUMP(p->codes[i].a);
+      REG_NEXT();
+    CASE(ROP_JMP_IFNOT):
+      if (!TO_BOOL(RB))
+        REG_JUMP(p->codes[i].a);
+      REG_NEXT();
+    CASE(ROP_JMP_IFNOT_GT): REG_JMP_IFNOT_BINARY_OP(>); REG_NEXT();
+    CASE(ROP_JMP_IFNOT_GE): REG_JMP_IFNOT_BINARY_OP(>=); REG_NEXT();
+    CASE(ROP_JMP_IFNOT_EQEQ): REG_JMP_IFNOT_BINARY_OP(==); REG_NEXT();
+    CASE(ROP_JMP_IFNOT_NEQ): REG_JMP_IFNOT_BINARY_OP(!=); REG_NEXT();
+    CASE(ROP_JMP_IFNOT_LT): REG_JMP_IFNOT_BINARY_OP(<); REG_NEXT();
+    CASE(ROP_JMP_IFNOT_LE): REG_JMP_IFNOT_BINARY_OP(<=); REG_NEXT();
+    CASE(ROP_FORPREP):
+      if (!for_prep(RB, RC, REG(p->codes[i].c + 1)))
+        REG_JUMP(p->codes[i].a);
+      REG_NEXT();
+    CASE(ROP_FORLOOP):
+      if (for_loop(&RB, RC, REG(p->codes[i].c + 1)))
+        REG_JUMP(p->codes[i].a);
+      REG_NEXT();
+    CASE(ROP_CALL):
+      v = RB;
+      reg_check_function(p, v);
+      if (e->framesidx == e->frameslen) {
+        e->frameslen *= 2;
+        e->frames = realloc(e->frames, e->frameslen * sizeof(frame));
+      }
+      f = &e->frames[e->framesidx++];
+      if (e->framesidx > e->max_frames)
+        e->max_frames = e->framesidx;
+      f->pc = i;
+      f->base = base = (p->codes[i].a & 0x7fff) + base;
+      f->argc = p->codes[i].c;
+      REG_JUMP(AS_LONG(v));
+    CASE(ROP_TAILCALL):
+      v = RB;
+      reg_check_function(p, v);
+      j = (p->codes[i].a & 0x7fff) + base;
+      for (k = 0; k < p->codes[i].c; ++k)
+        r[base + k] = r[j + k];
+      e->frames[e->framesidx - 1].argc = p->codes[i].c;
+      REG_JUMP(AS_LONG(v));
+    CASE(ROP_FCALL):
+      gfuncs[p->codes[i].b].func(e, &RA, p->codes[i].c);
+      RA = e->stack[--e->stackidx];
+      REG_NEXT();
+    CASE(ROP_ENTER):
+      if (e->frames[e->framesidx - 1].argc != p->codes[i].b) {
+        printf("Invalid number of arguments: %d (expected %d)\n",
+               e->frames[e->framesidx - 1].argc, p->codes[i].b);
+        exit(1);
+      }
+      r = reserve_registers(r, &cap, base + p->codes[i].a);
+      for (j = base + p->codes[i].b; j < base + p->codes[i].a; ++j)
+        r[j] = BOOL_VAL(false);
+      REG_NEXT();
+    CASE(ROP_RETURN):
+      r[base] = RA;
+      i = e->frames[--e->framesidx].pc;
+      base = e->frames[e->framesidx - 1].base;
+      REG_NEXT();
+    CASE(ROP_PRINT): print_value(RA); REG_NEXT();
+    CASE(ROP_UNOT): RA = BOOL_VAL(!TO_BOOL(RB)); REG_NEXT();
+    CASE(ROP_UADD): REG_UNARY_OP(+); REG_NEXT();
+    CASE(ROP_UMINUS): REG_UNARY_OP(-); REG_NEXT();
+    CASE(ROP_ADD): REG_BINARY_OP(+); REG_NEXT();
+    CASE(ROP_MINUS): REG_BINARY_OP(-); REG_NEXT();
+    CASE(ROP_TIMES): REG_BINARY_OP(*); REG_NEXT();
+    CASE(ROP_DIVIDE): REG_BINARY_OP(/); REG_NEXT();
+    CASE(ROP_GT): REG_LOGICAL_BINARY_OP(>); REG_NEXT();
+    CASE(ROP_GE): REG_LOGICAL_BINARY_OP(>=); REG_NEXT();
+    CASE(ROP_EQEQ): REG_LOGICAL_BINARY_OP(==); REG_NEXT();
+    CASE(ROP_NEQ): REG_LOGICAL_BINARY_OP(!=); REG_NEXT();
+    CASE(ROP_LT): REG_LOGICAL_BINARY_OP(<); REG_NEXT();
+    CASE(ROP_LE): REG_LOGICAL_BINARY_OP(<=); REG_NEXT();
+    CASE(ROP_HALT):
+      goto halt;
+  }
+halt:
+  free(r);
+  if (e->stackidx != 0) {
+    printf("stack not consumed\n");
+    exit(1);
+  }
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "state.h"
 #include "node.h"
 
@@ -15,13 +16,31 @@ node_pool* new_node_pool(node_pool* prev) {
   return np;
 }
 
+arena* new_arena(arena* prev, size_t length) {
+  arena* a = (arena*)malloc(sizeof(arena));
+  a->index = 0;
+  a->length = length;
+  a->next_arena = NULL;
+  a->data = (char*)malloc(length);
+  if (prev != NULL) {
+    prev->next_arena = a;
+  }
+  return a;
+}
+
 state* new_state() {
   state* s = (state*)malloc(sizeof(state));
   if (s == NULL)
     return NULL;
   s->node = NULL;
   s->scanner = NULL;
+  s->line = 1;
+  s->newlines = 0;
   s->current_pool = s->top_pool = new_node_pool(NULL);
+  s->current_arena = s->top_arena = new_arena(NULL, 4096);
+  s->symbols.count = 0;
+  s->symbols.length = 256;
+  s->symbols.symbols = (char**)calloc(s->symbols.length, sizeof(char*));
   return s;
 }
 
@@ -29,7 +48,20 @@ node* new_node(state* s) {
   if (s->current_pool->index == s->current_pool->length) {
     s->current_pool = new_node_pool(s->current_pool);
   }
-  return &s->current_pool->nodes[s->current_pool->index++];
+  node* n = &s->current_pool->nodes[s->current_pool->index++];
+  n->line = s->line;
+  return n;
+}
+
+// Token text is bump allocated and freed with the state.
+void* arena_alloc(state* s, size_t size) {
+  void* p;
+  if (s->current_arena->index + size > s->current_arena->length) {
+    s->current_arena = new_arena(s->current_arena, size > 4096 ? size : 4096);
+  }
+  p = s->current_arena->data + s->current_arena->index;
+  s->current_arena->index += size;
+  return p;
 }
 
 void free_node_pools(node_pool* np) {
@@ -42,7 +74,71 @@ void free_node_pools(node_pool* np) {
   }
 }
 
+void free_arenas(arena* a) {
+  arena* p;
+  while (a != NULL) {
+    p = a;
+    free(p->data);
+    a = p->next_arena;
+    free(p);
+  }
+}
+
+static uint32_t hash_symbol(const char* str, size_t len) {
+  uint32_t h = 2166136261u;
+  while (len--)
+    h = (h ^ (unsigned char)*str++) * 16777619u;
+  return h;
+}
+
+static char** find_symbol(symbol_table* t, const char* str, size_t len) {
+  uint32_t i = hash_symbol(str, len) & (t->length - 1);
+  while (t->symbols[i] != NULL &&
+         (strncmp(t->symbols[i], str, len) != 0 || t->symbols[i][len] != '\0'))
+    i = (i + 1) & (t->length - 1);
+  return &t->symbols[i];
+}
+
+static void grow_symbol_table(symbol_table* t) {
+  uint32_t i, length = t->length;
+  char** symbols = t->symbols;
+  t->length *= 2;
+  t->symbols = (char**)calloc(t->length, sizeof(char*));
+  for (i = 0; i < length; ++i)
+    if (symbols[i] != NULL)
+      *find_symbol(t, symbols[i], strlen(symbols[i])) = symbols[i];
+  free(symbols);
+}
+
+static char* add_symbol(state* s, char** p, char* symbol) {
+  *p = symbol;
+  if (++s->symbols.count * 2 > s->symbols.length)
+    grow_symbol_table(&s->symbols);
+  return symbol;
+}
+
+// Returns the unique copy of the string, so identifiers can be compared by
+// pointer.
+char* intern(state* s, const char* str, size_t len) {
+  char** p = find_symbol(&s->symbols, str, len);
+  char* symbol;
+  if (*p != NULL)
+    return *p;
+  symbol = (char*)arena_alloc(s, len + 1);
+  memcpy(symbol, str, len);
+  symbol[len] = '\0';
+  return add_symbol(s, p, symbol);
+}
+
+// Interns a string with static storage without copying it.
+char* intern_static(state* s, char* str) {
+  char** p = find_symbol(&s->symbols, str, strlen(str));
+  return *p != NULL ? *p : add_symbol(s, p, str);
+}
+
 void free_state(state* s) {
   free_node_pools(s->top_pool);
+  free_arenas(s->top_arena);
+  free(s->symbols.symbols);
   free(s);
 }
@@ -1,6 +1,7 @@
 #ifndef STATE_H
 #define STATE_H
 
+#include <stddef.h>
 #include "node.h"
 
 typedef struct node_pool {
@@ -10,15 +11,36 @@ typedef struct node_pool {
   struct node_pool* next_pool;
 } node_pool;
 
+typedef struct arena {
+  size_t index;
+  size_t length;
+  char* data;
+  struct arena* next_arena;
+} arena;
+
+typedef struct symbol_table {
+  uint32_t count;
+  uint32_t length;
+  char** symbols;
+} symbol_table;
+
 typedef struct state {
   struct node* node;
   void* scanner;
   node_pool* top_pool;
   node_pool* current_pool;
+  arena* top_arena;
+  arena* current_arena;
+  symbol_table symbols;
+  uint32_t line;
+  uint32_t newlines;
 } state;
 
 state* new_state();
 node* new_node(state*);
+void* arena_alloc(state*, size_t);
+char* intern(state*, const char*, size_t);
+char* intern_static(state*, char*);
 void free_state(state*);
 
 #endif
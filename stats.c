@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "state.h"
+#include "vm.h"
+
+// The numbers --stats reports. Times are in seconds. What the run did not
+// observe stays negative and is left out, e.g. the syntax tree of a bytecode
+// file, or the instructions executed by the JIT.
+typedef struct stats {
+  double parse_time;
+  double codegen_time;
+  double optimize_time;
+  double load_time;
+  double execute_time;
+  long nodes;
+  long node_pools;
+  long codes;
+  long constants;
+  long variables;
+  long long instructions;
+  long max_stack;
+  long max_frames;
+  long max_rss;
+} stats;
+
+static void init_stats(stats* st) {
+  st->parse_time = st->codegen_time = st->optimize_time = st->load_time = st->execute_time = -1;
+  st->nodes = st->node_pools = st->codes = st->constants = st->variables = -1;
+  st->instructions = st->max_stack = st->max_frames = st->max_rss = -1;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_nodes(stats* st, state* s) {
+  node_pool* np;
+  st->nodes = st->node_pools = 0;
+  for (np = s->top_pool; np != NULL; np = np->next_pool) {
+    st->nodes += np->index;
+    st->node_pools++;
+  }
+}
+
+static void count_codes(stats* st, env* e) {
+  st->codes = e->codesidx;
+  st->constants = e->constantsidx;
+  st->variables = e->variableslen;
+}
+
+// The interpreter loop with one increment per dispatch, run under --stats.
+#define COUNT
+#include "vm.c"
+#undef COUNT
+#undef DISPATCH_HOOK
+#define DISPATCH_HOOK()
+
+static void print_stats(stats* st, bool json) {
+  struct rusage ru;
+  int i, n = 0;
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    st->max_rss = ru.ru_maxrss;
+  struct { const char* name; double value; } times[] = {
+    { "parse_time", st->parse_time },
+    { "codegen_time", st->codegen_time },
+    { "optimize_time", st->optimize_time },
+    { "load_time", st->load_time },
+    { "execute_time", st->execute_time },
+  };
+  struct { const char* name; long long value; } counts[] = {
+    { "nodes", st->nodes },
+    { "node_pools", st->node_pools },
+    { "codes", st->codes },
+    { "constants", st->constants },
+    { "variables", st->variables },
+    { "instructions", st->instructions },
+    { "max_stack", st->max_stack },
+    { "max_frames", st->max_frames },
+    { "max_rss_kb", st->max_rss },
+  };
+  if (json)
+    fprintf(stderr, "{");
+  for (i = 0; i < sizeof(times) / sizeof(times[0]); ++i) {
+    if (times[i].value < 0)
+      continue;
+    if (json)
+      fprintf(stderr, "%s\"%s\":%.6f", n++ ? "," : "", times[i].name, times[i].value);
+    else
+      fprintf(stderr, "%-16s %.6f\n", times[i].name, times[i].value);
+  }
+  for (i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+    if (counts[i].value < 0)
+      continue;
+    if (json)
+      fprintf(stderr, "%s\"%s\":%lld", n++ ? "," : "", counts[i].name, counts[i].value);
+    else
+      fprintf(stderr, "%-16s %lld\n", counts[i].name, counts[i].value);
+  }
+  if (json)
+    fprintf(stderr, "}\n");
+}
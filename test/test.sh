@@ -1,17 +1,51 @@
 #!/bin/bash
 bin=$(dirname $0)/../minivm
 ret=0
-for f in $(dirname $0)/*/*.in; do
-  output=$($bin < $f | sed "s/\n//g")
-  expected=$(cat ${f%.in}.out)
+mvc=$(mktemp --suffix=.mvc)
+aot=$(mktemp)
+trap 'rm -f $mvc $aot $aot.c' EXIT
+check() {
+  expected=$(cat $2)
   if [[ X$output != X$expected ]]; then
     echo Test failed!
-    echo $f
-    cat $f
+    echo $1
+    cat $1
     echo Expected: $expected
     echo Output: $output
     echo
     ret=1
   fi
+}
+for f in $(dirname $0)/*/*.in; do
+  if [[ $f == */nanbox/* && $NANBOX != 1 ]]; then
+    continue
+  fi
+  args=
+  input=/dev/null
+  if [[ -f ${f%.in}.txt ]]; then
+    args="--input ${f%.in}.txt"
+    input=${f%.in}.txt
+  fi
+  if [[ $MVC == 1 ]]; then
+    output=$({ $bin --compile $mvc < $f && $bin $FLAGS $args $mvc; } | sed "s/\n//g")
+  elif [[ $AOT == 1 ]]; then
+    # The compiled program reads its input from stdin.
+    output=$({ $bin --emit-c < $f > $aot.c && cc $CFLAGS -Wall -Werror -I$(dirname $0)/.. -o $aot $aot.c &&
+      $aot < $input; } 2>&1 | sed "s/\n//g")
+  else
+    output=$($bin $FLAGS $args < $f | sed "s/\n//g")
+  fi
+  check $f ${f%.in}.out
+done
+# Each bytecode/*.src is compiled, and the bytes listed in the .patch (an offset
+# and the bytes in hex per line) are overwritten before the file is run.
+for f in $(dirname $0)/bytecode/*.src; do
+  rm -f $mvc
+  $bin --compile $mvc < $f
+  while read -r offset bytes; do
+    printf "$(sed 's/../\\x&/g' <<< $bytes)" | dd of=$mvc bs=1 seek=$offset conv=notrunc status=none
+  done < ${f%.src}.patch
+  output=$($bin $mvc | sed "s|$mvc|test.mvc|g")
+  check $f ${f%.src}.out
 done
 exit $ret
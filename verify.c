@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "opcode.h"
+#include "vm.h"
+
+/*
+ * Checks the bytecode before it runs, so that the interpreter needs no checks
+ * of its own. Starting from the top level and from each function loaded by
+ * func, it follows every path and requires that
+ *   - jumps and fallthroughs stay within the code and within their function,
+ *   - every path reaches an instruction with the same stack depth,
+ *   - no instruction pops more than its function has pushed,
+ *   - variable, local, constant and builtin indices are in range, and a
+ *     function has no more locals than codegen can give out,
+ *   - the top level halts with an empty stack, a function returns exactly one
+ *     value and a tail call leaves nothing but its arguments.
+ * The deepest stack of the top level and of any function body are kept in
+ * stack_depth and frame_depth; the stack is sized from them. The pcs where the
+ * functions start are marked in entries, the only ones a call may jump to.
+ */
+
+typedef struct verifier {
+  env* e;
+  int32_t* depths;
+  int32_t* owners;
+  int32_t* work;
+  uint32_t worklen;
+  int32_t* functions;
+  uint32_t functionslen;
+} verifier;
+
+static void verify_error(int pc, const char* message) {
+  printf("Invalid bytecode at %d: %s\n", pc, message);
+  exit(1);
+}
+
+static void verify_visit(verifier* v, int from, int64_t pc, int owner, int depth) {
+  if (pc < 0 || pc >= v->e->codesidx)
+    verify_error(from, "jump out of the code");
+  if (v->owners[pc] < 0) {
+    v->owners[pc] = owner;
+    v->depths[pc] = depth;
+    v->work[v->worklen++] = pc;
+  } else if (v->owners[pc] != owner) {
+    verify_error(from, "jump into another function");
+  } else if (v->depths[pc] != depth) {
+    verify_error(pc, "inconsistent stack depth");
+  }
+}
+
+static void verify_local(verifier* v, int pc, int index, int locals) {
+  if (index < 0 || index >= locals)
+    verify_error(pc, "local out of range");
+}
+
+static void verify_global(verifier* v, int pc, int index) {
+  if (index < 0 || index >= v->e->variableslen)
+    verify_error(pc, "variable out of range");
+}
+
+// Follows the function whose code starts at start (the top level is owner 0)
+// and returns its deepest stack.
+static int verify_function(verifier* v, int start, int owner) {
+  env* e = v->e;
+  int pc, pops, pushes, depth, max = 0, locals = 0;
+  int64_t target;
+  if (owner > 0) {
+    if (GET_OPCODE(e->codes[start]) != OP_ENTER)
+      verify_error(start, "function without enter");
+    locals = GET_ARG_A(e->codes[start]);
+    if (GET_ARG_B(e->codes[start]) < 0 || locals < GET_ARG_B(e->codes[start]) || locals > MAX_VARIABLES)
+      verify_error(start, "invalid enter");
+  }
+  verify_visit(v, start, start, owner, 0);
+  while (v->worklen > 0) {
+    pc = v->work[--v->worklen];
+    uint64_t code = e->codes[pc];
+    int a = GET_ARG_A(code), b = GET_ARG_B(code);
+    bool jump = false, next = true;
+    depth = v->depths[pc];
+    pops = pushes = 0;
+    switch (GET_OPCODE(code)) {
+      case OP_POP: pops = 1; break;
+      case OP_DUP: pops = 1; pushes = 2; break;
+      case OP_LET: verify_global(v, pc, a); pops = 1; break;
+      case OP_LET_LOCAL: verify_local(v, pc, a, locals); pops = 1; break;
+      case OP_JMP: jump = true; next = false; break;
+      case OP_JMP_IF: case OP_JMP_IFNOT: pops = 1; jump = true; break;
+      case OP_JMP_IFNOT_GT: case OP_JMP_IFNOT_GE: case OP_JMP_IFNOT_EQEQ:
+      case OP_JMP_IFNOT_NEQ: case OP_JMP_IFNOT_LT: case OP_JMP_IFNOT_LE:
+      case OP_JMP_IFNOT_GT_LL: case OP_JMP_IFNOT_GE_LL: case OP_JMP_IFNOT_EQEQ_LL:
+      case OP_JMP_IFNOT_NEQ_LL: case OP_JMP_IFNOT_LT_LL: case OP_JMP_IFNOT_LE_LL:
+      case OP_JMP_IFNOT_GT_DD: case OP_JMP_IFNOT_GE_DD: case OP_JMP_IFNOT_EQEQ_DD:
+      case OP_JMP_IFNOT_NEQ_DD: case OP_JMP_IFNOT_LT_DD: case OP_JMP_IFNOT_LE_DD:
+      case OP_JMP_IFNOT_GT_LONG: case OP_JMP_IFNOT_GE_LONG: case OP_JMP_IFNOT_EQEQ_LONG:
+      case OP_JMP_IFNOT_NEQ_LONG: case OP_JMP_IFNOT_LT_LONG: case OP_JMP_IFNOT_LE_LONG:
+      case OP_JMP_IFNOT_GT_DOUBLE: case OP_JMP_IFNOT_GE_DOUBLE: case OP_JMP_IFNOT_EQEQ_DOUBLE:
+      case OP_JMP_IFNOT_NEQ_DOUBLE: case OP_JMP_IFNOT_LT_DOUBLE: case OP_JMP_IFNOT_LE_DOUBLE:
+        pops = 2; jump = true; break;
+      case OP_FORPREP: case OP_FORLOOP:
+        verify_global(v, pc, b);
+        pops = pushes = 2; jump = true; break;
+      case OP_FORPREP_LOCAL: case OP_FORLOOP_LOCAL:
+        verify_local(v, pc, b, locals);
+        pops = pushes = 2; jump = true; break;
+      case OP_CALL:
+        verify_global(v, pc, a);
+        if (b < 0)
+          verify_error(pc, "invalid number of arguments");
+        pops = b; pushes = 1; break;
+      case OP_TAILCALL:
+        verify_global(v, pc, a);
+        if (owner == 0 || b < 0 || depth != b)
+          verify_error(pc, "invalid tail call");
+        next = false; break;
+      case OP_ENTER:
+        if (pc != start)
+          verify_error(pc, "enter in the middle of a function");
+        break;
+      case OP_RETURN:
+        if (owner == 0 || depth != 1)
+          verify_error(pc, "invalid return");
+        next = false; break;
+      case OP_PRINT: pops = 1; break;
+      case OP_FCALL:
+        if (a < 0 || a >= sizeof(gfuncs) / sizeof(func) || b < 0)
+          verify_error(pc, "invalid builtin call");
+        pops = b; pushes = 1; break;
+      case OP_UNOT: case OP_UADD: case OP_UMINUS:
+      case OP_IADD: case OP_IMINUS: case OP_IADD_LONG: case OP_IMINUS_LONG:
+      case OP_IGT: case OP_IGE: case OP_IEQEQ: case OP_INEQ: case OP_ILT: case OP_ILE:
+      case OP_IGT_LONG: case OP_IGE_LONG: case OP_IEQEQ_LONG:
+      case OP_INEQ_LONG: case OP_ILT_LONG: case OP_ILE_LONG:
+        pops = pushes = 1; break;
+      case OP_ADD: case OP_MINUS: case OP_TIMES: case OP_DIVIDE:
+      case OP_ADD_LL: case OP_MINUS_LL: case OP_TIMES_LL: case OP_DIVIDE_LL:
+      case OP_ADD_DD: case OP_MINUS_DD: case OP_TIMES_DD: case OP_DIVIDE_DD:
+      case OP_ADD_LONG: case OP_MINUS_LONG: case OP_TIMES_LONG: case OP_DIVIDE_LONG:
+      case OP_ADD_DOUBLE: case OP_MINUS_DOUBLE: case OP_TIMES_DOUBLE: case OP_DIVIDE_DOUBLE:
+      case OP_GT: case OP_GE: case OP_EQEQ: case OP_NEQ: case OP_LT: case OP_LE:
+      case OP_GT_LL: case OP_GE_LL: case OP_EQEQ_LL: case OP_NEQ_LL: case OP_LT_LL: case OP_LE_LL:
+      case OP_GT_DD: case OP_GE_DD: case OP_EQEQ_DD: case OP_NEQ_DD: case OP_LT_DD: case OP_LE_DD:
+      case OP_GT_LONG: case OP_GE_LONG: case OP_EQEQ_LONG:
+      case OP_NEQ_LONG: case OP_LT_LONG: case OP_LE_LONG:
+      case OP_GT_DOUBLE: case OP_GE_DOUBLE: case OP_EQEQ_DOUBLE:
+      case OP_NEQ_DOUBLE: case OP_LT_DOUBLE: case OP_LE_DOUBLE:
+        pops = 2; pushes = 1; break;
+      case OP_INC: case OP_INC_LONG: verify_global(v, pc, a); break;
+      case OP_INC_LOCAL: case OP_INC_LOCAL_LONG: verify_local(v, pc, a, locals); break;
+      case OP_LOAD_BOOL: case OP_LOAD_LONG: case OP_LOAD_DOUBLE:
+        if (a < 0 || a >= e->constantsidx)
+          verify_error(pc, "constant out of range");
+        pushes = 1; break;
+      case OP_LOAD_IDENT: verify_global(v, pc, a); pushes = 1; break;
+      case OP_LOAD_LOCAL_IDENT: verify_local(v, pc, a, locals); pushes = 1; break;
+      case OP_LOAD_LOCAL_IDENT2:
+        verify_local(v, pc, a, locals);
+        verify_local(v, pc, b, locals);
+        pushes = 2; break;
+      case OP_LOAD_FUNC:
+        target = (int64_t)pc + a + 1;
+        if (target < 0 || target >= e->codesidx)
+          verify_error(pc, "function out of the code");
+        if (v->owners[target] < 0)
+          v->functions[v->functionslen++] = target;
+        else if (v->depths[target] != 0 || GET_OPCODE(e->codes[target]) != OP_ENTER)
+          verify_error(pc, "invalid function");
+        pushes = 1; break;
+      case OP_HALT:
+        if (owner != 0 || depth != 0)
+          verify_error(pc, "invalid halt");
+        next = false; break;
+      default: verify_error(pc, "unknown opcode");
+    }
+    if (depth < pops)
+      verify_error(pc, "stack underflow");
+    depth += pushes - pops;
+    if (depth > max)
+      max = depth;
+    if (jump)
+      verify_visit(v, pc, (int64_t)pc + a + 1, owner, depth);
+    if (next)
+      verify_visit(v, pc, (int64_t)pc + 1, owner, depth);
+  }
+  return max;
+}
+
+static void verify_codes(env* e) {
+  verifier v;
+  int i, depth;
+  v.e = e;
+  v.depths = malloc(e->codesidx * sizeof(int32_t));
+  v.owners = malloc(e->codesidx * sizeof(int32_t));
+  v.work = malloc(e->codesidx * sizeof(int32_t));
+  v.functions = malloc(e->codesidx * sizeof(int32_t));
+  v.worklen = v.functionslen = 0;
+  memset(v.owners, 0xff, e->codesidx * sizeof(int32_t));
+  if (e->codesidx == 0)
+    verify_error(0, "no code");
+  e->stack_depth = verify_function(&v, 0, 0);
+  e->frame_depth = 0;
+  free(e->entries);
+  e->entries = calloc(e->codesidx, sizeof(bool));
+  for (i = 0; i < v.functionslen; ++i) {
+    if (v.owners[v.functions[i]] >= 0)
+      continue;
+    e->entries[v.functions[i]] = true;
+    depth = verify_function(&v, v.functions[i], i + 1);
+    if (depth > e->frame_depth)
+      e->frame_depth = depth;
+  }
+  free(v.depths);
+  free(v.owners);
+  free(v.work);
+  free(v.functions);
+}
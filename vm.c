@@ -4,126 +4,436 @@
 #include "opcode.h"
 #include "vm.h"
 
-inline static bool evaluate_bool(env* e) {
-  value v = e->stack[--e->stackidx];
-  switch (v.type) {
-    case VT_BOOL: return v.bval;
-    case VT_LONG: return v.lval != 0.0;
-    case VT_DOUBLE: return v.dval != 0;
-  }
-  return true;
-}
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO
+#endif
+
+// This file is included a second time with PROFILE defined, by profile.c, to
+// build the profiling interpreter, and a third time with COUNT defined, by
+// stats.c, to count the instructions for --stats. Only those run a hook on each
+// dispatch.
+#undef DISPATCH_HOOK
+#ifdef PROFILE
+#define DISPATCH_HOOK()     PROFILE_STEP()
+#elif defined(COUNT)
+#define DISPATCH_HOOK()     (++count)
+#else
+#define DISPATCH_HOOK()
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+#define SWITCH(op)          DISPATCH_HOOK(); goto *dispatch_table[op];
+#define CASE(op)            L_##op
+#define DEFAULT             L_DEFAULT
+#define NEXT()              do { ++i; DISPATCH_HOOK(); goto *dispatch_table[GET_OPCODE(e->codes[i])]; } while (0)
+#define REDISPATCH()        do { DISPATCH_HOOK(); goto *dispatch_table[GET_OPCODE(e->codes[i])]; } while (0)
+#else
+#define SWITCH(op)          dispatch: DISPATCH_HOOK(); switch (op)
+#define CASE(op)            case op
+#define DEFAULT             default
+#define NEXT()              do { ++i; goto dispatch; } while (0)
+#define REDISPATCH()        goto dispatch
+#endif
 
+// The interpreter keeps the stack pointer and the top of the stack in locals.
+// The slots below the top are in memory from e->stack + 1 up to sp - 1, and the
+// top is spilled to *sp only when a builtin or a call needs the whole stack.
+#undef STACK_TOP
+#undef STACK_SECOND
+#undef STACK_PUSH
+#undef STACK_DROP
+#define STACK_TOP           tos
+#define STACK_SECOND        sp[-1]
+#define STACK_PUSH(v)       (*sp++ = tos, tos = (v))
+#define STACK_DROP()        (tos = *--sp)
+
+#ifdef PROFILE
+static void execute_codes_profile(env* e, profile* p) {
+  PROFILE_LOCALS;
+#elif defined(COUNT)
+static void execute_codes_count(env* e, long long* instructions) {
+  long long count = 0;
+#else
 static void execute_codes(env* e) {
-  int i, j, offset = e->variableslen - 1; value v;
-  e->stack = calloc(1024, sizeof(value));
-  for (i = 0; i < e->codesidx; ++i) {
-    /* printf("\n"); */
-    /* printf("%d %d %d\n", i, e->stackidx, GET_OPCODE(e->codes[i])); */
-    /* for (j = 0; j < 10; j++) { */
-    /*   printf("%ld ", e->stack[j].lval); */
-    /* } */
-    /* printf("\n"); */
-    /* for (j = 0; j < 10; j++) { */
-    /*   printf("%ld ", e->variables[j].value.lval); */
-    /* } */
-    /* printf("\n"); */
-    switch (GET_OPCODE(e->codes[i])) {
-      case OP_POP:
-        --e->stackidx;
-        break;
-      case OP_DUP:
-        e->stack[e->stackidx] = e->stack[e->stackidx - 1];
-        ++e->stackidx;
-        break;
-      case OP_LET:
-        e->variables[GET_ARG_A(e->codes[i])].value = e->stack[--e->stackidx];
-        break;
-      case OP_LET_LOCAL:
-        e->variables[offset - GET_ARG_A(e->codes[i])].value = e->stack[--e->stackidx];
-        break;
-      case OP_JMP:
+#endif
+  int i = 0, j, base; long target; value v, tos = BOOL_VAL(false), *sp;
+#ifdef USE_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+  static void* dispatch_table[256] = {
+    [0 ... 255] = &&L_DEFAULT,
+    [OP_POP] = &&L_OP_POP,
+    [OP_DUP] = &&L_OP_DUP,
+    [OP_LET] = &&L_OP_LET,
+    [OP_LET_LOCAL] = &&L_OP_LET_LOCAL,
+    [OP_JMP] = &&L_OP_JMP,
+    [OP_JMP_IF] = &&L_OP_JMP_IF,
+    [OP_JMP_IFNOT] = &&L_OP_JMP_IFNOT,
+    [OP_JMP_IFNOT_GT] = &&L_OP_JMP_IFNOT_GT,
+    [OP_JMP_IFNOT_GE] = &&L_OP_JMP_IFNOT_GE,
+    [OP_JMP_IFNOT_EQEQ] = &&L_OP_JMP_IFNOT_EQEQ,
+    [OP_JMP_IFNOT_NEQ] = &&L_OP_JMP_IFNOT_NEQ,
+    [OP_JMP_IFNOT_LT] = &&L_OP_JMP_IFNOT_LT,
+    [OP_JMP_IFNOT_LE] = &&L_OP_JMP_IFNOT_LE,
+    [OP_JMP_IFNOT_GT_LL] = &&L_OP_JMP_IFNOT_GT_LL,
+    [OP_JMP_IFNOT_GE_LL] = &&L_OP_JMP_IFNOT_GE_LL,
+    [OP_JMP_IFNOT_EQEQ_LL] = &&L_OP_JMP_IFNOT_EQEQ_LL,
+    [OP_JMP_IFNOT_NEQ_LL] = &&L_OP_JMP_IFNOT_NEQ_LL,
+    [OP_JMP_IFNOT_LT_LL] = &&L_OP_JMP_IFNOT_LT_LL,
+    [OP_JMP_IFNOT_LE_LL] = &&L_OP_JMP_IFNOT_LE_LL,
+    [OP_JMP_IFNOT_GT_DD] = &&L_OP_JMP_IFNOT_GT_DD,
+    [OP_JMP_IFNOT_GE_DD] = &&L_OP_JMP_IFNOT_GE_DD,
+    [OP_JMP_IFNOT_EQEQ_DD] = &&L_OP_JMP_IFNOT_EQEQ_DD,
+    [OP_JMP_IFNOT_NEQ_DD] = &&L_OP_JMP_IFNOT_NEQ_DD,
+    [OP_JMP_IFNOT_LT_DD] = &&L_OP_JMP_IFNOT_LT_DD,
+    [OP_JMP_IFNOT_LE_DD] = &&L_OP_JMP_IFNOT_LE_DD,
+    [OP_JMP_IFNOT_GT_LONG] = &&L_OP_JMP_IFNOT_GT_LONG,
+    [OP_JMP_IFNOT_GE_LONG] = &&L_OP_JMP_IFNOT_GE_LONG,
+    [OP_JMP_IFNOT_EQEQ_LONG] = &&L_OP_JMP_IFNOT_EQEQ_LONG,
+    [OP_JMP_IFNOT_NEQ_LONG] = &&L_OP_JMP_IFNOT_NEQ_LONG,
+    [OP_JMP_IFNOT_LT_LONG] = &&L_OP_JMP_IFNOT_LT_LONG,
+    [OP_JMP_IFNOT_LE_LONG] = &&L_OP_JMP_IFNOT_LE_LONG,
+    [OP_JMP_IFNOT_GT_DOUBLE] = &&L_OP_JMP_IFNOT_GT_DOUBLE,
+    [OP_JMP_IFNOT_GE_DOUBLE] = &&L_OP_JMP_IFNOT_GE_DOUBLE,
+    [OP_JMP_IFNOT_EQEQ_DOUBLE] = &&L_OP_JMP_IFNOT_EQEQ_DOUBLE,
+    [OP_JMP_IFNOT_NEQ_DOUBLE] = &&L_OP_JMP_IFNOT_NEQ_DOUBLE,
+    [OP_JMP_IFNOT_LT_DOUBLE] = &&L_OP_JMP_IFNOT_LT_DOUBLE,
+    [OP_JMP_IFNOT_LE_DOUBLE] = &&L_OP_JMP_IFNOT_LE_DOUBLE,
+    [OP_FORPREP] = &&L_OP_FORPREP,
+    [OP_FORPREP_LOCAL] = &&L_OP_FORPREP_LOCAL,
+    [OP_FORLOOP] = &&L_OP_FORLOOP,
+    [OP_FORLOOP_LOCAL] = &&L_OP_FORLOOP_LOCAL,
+    [OP_CALL] = &&L_OP_CALL,
+    [OP_TAILCALL] = &&L_OP_TAILCALL,
+    [OP_ENTER] = &&L_OP_ENTER,
+    [OP_RETURN] = &&L_OP_RETURN,
+    [OP_PRINT] = &&L_OP_PRINT,
+    [OP_FCALL] = &&L_OP_FCALL,
+    [OP_UNOT] = &&L_OP_UNOT,
+    [OP_UADD] = &&L_OP_UADD,
+    [OP_UMINUS] = &&L_OP_UMINUS,
+    [OP_ADD] = &&L_OP_ADD,
+    [OP_MINUS] = &&L_OP_MINUS,
+    [OP_TIMES] = &&L_OP_TIMES,
+    [OP_DIVIDE] = &&L_OP_DIVIDE,
+    [OP_ADD_LL] = &&L_OP_ADD_LL,
+    [OP_MINUS_LL] = &&L_OP_MINUS_LL,
+    [OP_TIMES_LL] = &&L_OP_TIMES_LL,
+    [OP_DIVIDE_LL] = &&L_OP_DIVIDE_LL,
+    [OP_ADD_DD] = &&L_OP_ADD_DD,
+    [OP_MINUS_DD] = &&L_OP_MINUS_DD,
+    [OP_TIMES_DD] = &&L_OP_TIMES_DD,
+    [OP_DIVIDE_DD] = &&L_OP_DIVIDE_DD,
+    [OP_ADD_LONG] = &&L_OP_ADD_LONG,
+    [OP_MINUS_LONG] = &&L_OP_MINUS_LONG,
+    [OP_TIMES_LONG] = &&L_OP_TIMES_LONG,
+    [OP_DIVIDE_LONG] = &&L_OP_DIVIDE_LONG,
+    [OP_ADD_DOUBLE] = &&L_OP_ADD_DOUBLE,
+    [OP_MINUS_DOUBLE] = &&L_OP_MINUS_DOUBLE,
+    [OP_TIMES_DOUBLE] = &&L_OP_TIMES_DOUBLE,
+    [OP_DIVIDE_DOUBLE] = &&L_OP_DIVIDE_DOUBLE,
+    [OP_IADD] = &&L_OP_IADD,
+    [OP_IMINUS] = &&L_OP_IMINUS,
+    [OP_IADD_LONG] = &&L_OP_IADD_LONG,
+    [OP_IMINUS_LONG] = &&L_OP_IMINUS_LONG,
+    [OP_INC] = &&L_OP_INC,
+    [OP_INC_LOCAL] = &&L_OP_INC_LOCAL,
+    [OP_INC_LONG] = &&L_OP_INC_LONG,
+    [OP_INC_LOCAL_LONG] = &&L_OP_INC_LOCAL_LONG,
+    [OP_GT] = &&L_OP_GT,
+    [OP_GE] = &&L_OP_GE,
+    [OP_EQEQ] = &&L_OP_EQEQ,
+    [OP_NEQ] = &&L_OP_NEQ,
+    [OP_LT] = &&L_OP_LT,
+    [OP_LE] = &&L_OP_LE,
+    [OP_GT_LL] = &&L_OP_GT_LL,
+    [OP_GE_LL] = &&L_OP_GE_LL,
+    [OP_EQEQ_LL] = &&L_OP_EQEQ_LL,
+    [OP_NEQ_LL] = &&L_OP_NEQ_LL,
+    [OP_LT_LL] = &&L_OP_LT_LL,
+    [OP_LE_LL] = &&L_OP_LE_LL,
+    [OP_GT_DD] = &&L_OP_GT_DD,
+    [OP_GE_DD] = &&L_OP_GE_DD,
+    [OP_EQEQ_DD] = &&L_OP_EQEQ_DD,
+    [OP_NEQ_DD] = &&L_OP_NEQ_DD,
+    [OP_LT_DD] = &&L_OP_LT_DD,
+    [OP_LE_DD] = &&L_OP_LE_DD,
+    [OP_GT_LONG] = &&L_OP_GT_LONG,
+    [OP_GE_LONG] = &&L_OP_GE_LONG,
+    [OP_EQEQ_LONG] = &&L_OP_EQEQ_LONG,
+    [OP_NEQ_LONG] = &&L_OP_NEQ_LONG,
+    [OP_LT_LONG] = &&L_OP_LT_LONG,
+    [OP_LE_LONG] = &&L_OP_LE_LONG,
+    [OP_GT_DOUBLE] = &&L_OP_GT_DOUBLE,
+    [OP_GE_DOUBLE] = &&L_OP_GE_DOUBLE,
+    [OP_EQEQ_DOUBLE] = &&L_OP_EQEQ_DOUBLE,
+    [OP_NEQ_DOUBLE] = &&L_OP_NEQ_DOUBLE,
+    [OP_LT_DOUBLE] = &&L_OP_LT_DOUBLE,
+    [OP_LE_DOUBLE] = &&L_OP_LE_DOUBLE,
+    [OP_IGT] = &&L_OP_IGT,
+    [OP_IGE] = &&L_OP_IGE,
+    [OP_IEQEQ] = &&L_OP_IEQEQ,
+    [OP_INEQ] = &&L_OP_INEQ,
+    [OP_ILT] = &&L_OP_ILT,
+    [OP_ILE] = &&L_OP_ILE,
+    [OP_IGT_LONG] = &&L_OP_IGT_LONG,
+    [OP_IGE_LONG] = &&L_OP_IGE_LONG,
+    [OP_IEQEQ_LONG] = &&L_OP_IEQEQ_LONG,
+    [OP_INEQ_LONG] = &&L_OP_INEQ_LONG,
+    [OP_ILT_LONG] = &&L_OP_ILT_LONG,
+    [OP_ILE_LONG] = &&L_OP_ILE_LONG,
+    [OP_LOAD_BOOL] = &&L_OP_LOAD_BOOL,
+    [OP_LOAD_LONG] = &&L_OP_LOAD_LONG,
+    [OP_LOAD_DOUBLE] = &&L_OP_LOAD_DOUBLE,
+    [OP_LOAD_IDENT] = &&L_OP_LOAD_IDENT,
+    [OP_LOAD_LOCAL_IDENT] = &&L_OP_LOAD_LOCAL_IDENT,
+    [OP_LOAD_LOCAL_IDENT2] = &&L_OP_LOAD_LOCAL_IDENT2,
+    [OP_LOAD_FUNC] = &&L_OP_LOAD_FUNC,
+    [OP_HALT] = &&L_OP_HALT,
+  };
+#pragma GCC diagnostic pop
+#endif
+  alloc_stack(e);
+  sp = e->stack;
+  init_frames(e);
+  base = e->frames[0].base;
+  SWITCH(GET_OPCODE(e->codes[i])) {
+    CASE(OP_POP):
+      STACK_DROP();
+      NEXT();
+    CASE(OP_DUP):
+      STACK_PUSH(tos);
+      NEXT();
+    CASE(OP_LET):
+      e->variables[GET_ARG_A(e->codes[i])].value = tos;
+      STACK_DROP();
+      NEXT();
+    CASE(OP_LET_LOCAL):
+      e->variables[base + GET_ARG_A(e->codes[i])].value = tos;
+      STACK_DROP();
+      NEXT();
+    CASE(OP_JMP):
+      i += GET_ARG_A(e->codes[i]);
+      NEXT();
+    CASE(OP_JMP_IF):
+      v = tos;
+      STACK_DROP();
+      if (TO_BOOL(v))
         i += GET_ARG_A(e->codes[i]);
-        break;
-      case OP_JMP_IF:
-        if (evaluate_bool(e))
-          i += GET_ARG_A(e->codes[i]);
-        break;
-      case OP_JMP_IFNOT:
-        if (!evaluate_bool(e))
-          i += GET_ARG_A(e->codes[i]);
-        break;
-      case OP_UFCALL:
-        e->stack[e->stackidx++].lval = i;
-        i = e->variables[GET_ARG_A(e->codes[i])].value.lval;
-        break;
-      case OP_ALLOC:
-        offset += GET_ARG_A(e->codes[i]);
-        break;
-      case OP_RET:
-        i = e->variables[(offset -= GET_ARG_A(e->codes[i])) + 1].value.lval;
-        break;
-      case OP_FCALL: {
-        int len = GET_ARG_B(e->codes[i]);
-        gfuncs[GET_ARG_A(e->codes[i])].func(e, &e->stack[e->stackidx -= len], len);
-        break;
-      }
-      case OP_PRINT:
-        v = e->stack[--e->stackidx];
-        switch (v.type) {
-          case VT_BOOL:
-            if (v.bval)
-              printf("true\n");
-            else
-              printf("false\n");
-            break;
-          case VT_LONG: printf("%ld\n", v.lval); break;
-          case VT_DOUBLE: printf("%.9lf\n", v.dval); break;
-        }
-        break;
-      case OP_UNOT: {
-        bool b = !TO_BOOL(e->stack[e->stackidx - 1]);
-        e->stack[e->stackidx - 1].type = VT_BOOL;
-        e->stack[e->stackidx - 1].bval = b;
-        break;
+      NEXT();
+    CASE(OP_JMP_IFNOT):
+      v = tos;
+      STACK_DROP();
+      if (!TO_BOOL(v))
+        i += GET_ARG_A(e->codes[i]);
+      NEXT();
+    CASE(OP_JMP_IFNOT_GT): QUICKEN_BINARY_OP(OP_JMP_IFNOT_GT_LL, OP_JMP_IFNOT_GT_DD); JMP_IFNOT_BINARY_OP(>, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_GE): QUICKEN_BINARY_OP(OP_JMP_IFNOT_GE_LL, OP_JMP_IFNOT_GE_DD); JMP_IFNOT_BINARY_OP(>=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_EQEQ): QUICKEN_BINARY_OP(OP_JMP_IFNOT_EQEQ_LL, OP_JMP_IFNOT_EQEQ_DD); JMP_IFNOT_BINARY_OP(==, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_NEQ): QUICKEN_BINARY_OP(OP_JMP_IFNOT_NEQ_LL, OP_JMP_IFNOT_NEQ_DD); JMP_IFNOT_BINARY_OP(!=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_LT): QUICKEN_BINARY_OP(OP_JMP_IFNOT_LT_LL, OP_JMP_IFNOT_LT_DD); JMP_IFNOT_BINARY_OP(<, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_LE): QUICKEN_BINARY_OP(OP_JMP_IFNOT_LE_LL, OP_JMP_IFNOT_LE_DD); JMP_IFNOT_BINARY_OP(<=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_GT_LL): GUARD_BINARY_OP(IS_LONG, OP_JMP_IFNOT_GT); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, >, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_GE_LL): GUARD_BINARY_OP(IS_LONG, OP_JMP_IFNOT_GE); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, >=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_EQEQ_LL): GUARD_BINARY_OP(IS_LONG, OP_JMP_IFNOT_EQEQ); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, ==, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_NEQ_LL): GUARD_BINARY_OP(IS_LONG, OP_JMP_IFNOT_NEQ); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, !=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_LT_LL): GUARD_BINARY_OP(IS_LONG, OP_JMP_IFNOT_LT); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, <, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_LE_LL): GUARD_BINARY_OP(IS_LONG, OP_JMP_IFNOT_LE); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, <=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_GT_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_JMP_IFNOT_GT); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, >, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_GE_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_JMP_IFNOT_GE); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, >=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_EQEQ_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_JMP_IFNOT_EQEQ); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, ==, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_NEQ_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_JMP_IFNOT_NEQ); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, !=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_LT_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_JMP_IFNOT_LT); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, <, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_LE_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_JMP_IFNOT_LE); SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, <=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_GT_LONG): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, >, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_GE_LONG): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, >=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_EQEQ_LONG): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, ==, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_NEQ_LONG): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, !=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_LT_LONG): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, <, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_LE_LONG): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_LONG, <=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_GT_DOUBLE): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, >, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_GE_DOUBLE): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, >=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_EQEQ_DOUBLE): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, ==, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_NEQ_DOUBLE): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, !=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_LT_DOUBLE): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, <, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_JMP_IFNOT_LE_DOUBLE): SPECIALIZED_JMP_IFNOT_BINARY_OP(AS_DOUBLE, <=, i += GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_FORPREP):
+      if (!for_prep(e->variables[GET_ARG_B(e->codes[i])].value, STACK_SECOND, STACK_TOP))
+        i += GET_ARG_A(e->codes[i]);
+      NEXT();
+    CASE(OP_FORPREP_LOCAL):
+      if (!for_prep(e->variables[base + GET_ARG_B(e->codes[i])].value, STACK_SECOND, STACK_TOP))
+        i += GET_ARG_A(e->codes[i]);
+      NEXT();
+    CASE(OP_FORLOOP):
+      if (for_loop(&e->variables[GET_ARG_B(e->codes[i])].value, STACK_SECOND, STACK_TOP))
+        i += GET_ARG_A(e->codes[i]);
+      NEXT();
+    CASE(OP_FORLOOP_LOCAL):
+      if (for_loop(&e->variables[base + GET_ARG_B(e->codes[i])].value, STACK_SECOND, STACK_TOP))
+        i += GET_ARG_A(e->codes[i]);
+      NEXT();
+    CASE(OP_CALL):
+      target = function_entry(e, e->variables[GET_ARG_A(e->codes[i])].value);
+      base = push_frame(e, i, GET_ARG_B(e->codes[i]));
+      j = sp - e->stack;
+      if (j > e->max_call_stack)
+        e->max_call_stack = j;
+      if (j + e->frame_depth + 1 > e->stacklen) {
+        reserve_stack(e, j + e->frame_depth + 1);
+        sp = e->stack + j;
       }
-      case OP_UADD: UNARY_OP(+); break;
-      case OP_UMINUS: UNARY_OP(-); break;
-      case OP_ADD: BINARY_OP(+); break;
-      case OP_MINUS: BINARY_OP(-); break;
-      case OP_TIMES: BINARY_OP(*); break;
-      case OP_DIVIDE: BINARY_OP(/); break;
-      case OP_IADD: IBINARY_OP(+); break;
-      case OP_IMINUS: IBINARY_OP(-); break;
-      case OP_GT: LOGICAL_BINARY_OP(>); break;
-      case OP_GE: LOGICAL_BINARY_OP(>=); break;
-      case OP_EQEQ: LOGICAL_BINARY_OP(==); break;
-      case OP_NEQ: LOGICAL_BINARY_OP(!=); break;
-      case OP_LT: LOGICAL_BINARY_OP(<); break;
-      case OP_LE: LOGICAL_BINARY_OP(<=); break;
-      case OP_LOAD_BOOL:
-        e->stack[e->stackidx].type = VT_BOOL;
-        e->stack[e->stackidx++].bval = e->constants[GET_ARG_A(e->codes[i])].bval;
-        break;
-      case OP_LOAD_LONG:
-        e->stack[e->stackidx].type = VT_LONG;
-        e->stack[e->stackidx++].lval = e->constants[GET_ARG_A(e->codes[i])].lval;
-        break;
-      case OP_LOAD_DOUBLE:
-        e->stack[e->stackidx].type = VT_DOUBLE;
-        e->stack[e->stackidx++].dval = e->constants[GET_ARG_A(e->codes[i])].dval;
-        break;
-      case OP_LOAD_IDENT:
-        e->stack[e->stackidx++] = e->variables[GET_ARG_A(e->codes[i])].value;
-        break;
-      case OP_LOAD_LOCAL_IDENT:
-        e->stack[e->stackidx++] = e->variables[offset - GET_ARG_A(e->codes[i])].value;
-        break;
-      default: printf("Unknown opcode %d\n", GET_OPCODE(e->codes[i])); exit(1);
+      goto call;
+    CASE(OP_TAILCALL):
+      target = function_entry(e, e->variables[GET_ARG_A(e->codes[i])].value);
+      base = reuse_frame(e, GET_ARG_B(e->codes[i]));
+    call:
+      *sp = tos;
+      sp -= GET_ARG_B(e->codes[i]);
+      for (j = 0; j < GET_ARG_B(e->codes[i]); ++j)
+        e->variables[base + j].value = sp[j + 1];
+      tos = *sp;
+      i = target;
+      REDISPATCH();
+    CASE(OP_ENTER):
+      enter_frame(e, GET_ARG_A(e->codes[i]), GET_ARG_B(e->codes[i]));
+      NEXT();
+    CASE(OP_RETURN):
+      i = e->frames[--e->framesidx].pc;
+      base = e->frames[e->framesidx - 1].base;
+      NEXT();
+    CASE(OP_FCALL): {
+      int len = GET_ARG_B(e->codes[i]);
+      *sp = tos;
+      e->stackidx = sp + 1 - e->stack;
+      gfuncs[GET_ARG_A(e->codes[i])].func(e, &e->stack[e->stackidx -= len], len);
+      sp = e->stack + e->stackidx - 1;
+      tos = *sp;
+      NEXT();
+    }
+    CASE(OP_PRINT):
+      print_value(tos);
+      STACK_DROP();
+      NEXT();
+    CASE(OP_UNOT): {
+      bool b = !TO_BOOL(tos);
+      tos = BOOL_VAL(b);
+      NEXT();
     }
+    CASE(OP_UADD): UNARY_OP(+); NEXT();
+    CASE(OP_UMINUS): UNARY_OP(-); NEXT();
+    CASE(OP_ADD): QUICKEN_BINARY_OP(OP_ADD_LL, OP_ADD_DD); BINARY_OP(+); NEXT();
+    CASE(OP_MINUS): QUICKEN_BINARY_OP(OP_MINUS_LL, OP_MINUS_DD); BINARY_OP(-); NEXT();
+    CASE(OP_TIMES): QUICKEN_BINARY_OP(OP_TIMES_LL, OP_TIMES_DD); BINARY_OP(*); NEXT();
+    CASE(OP_DIVIDE): QUICKEN_BINARY_OP(OP_DIVIDE_LL, OP_DIVIDE_DD); BINARY_OP(/); NEXT();
+    CASE(OP_ADD_LL): GUARD_BINARY_OP(IS_LONG, OP_ADD); SPECIALIZED_BINARY_OP(AS_LONG, LONG_VAL, +); NEXT();
+    CASE(OP_MINUS_LL): GUARD_BINARY_OP(IS_LONG, OP_MINUS); SPECIALIZED_BINARY_OP(AS_LONG, LONG_VAL, -); NEXT();
+    CASE(OP_TIMES_LL): GUARD_BINARY_OP(IS_LONG, OP_TIMES); SPECIALIZED_BINARY_OP(AS_LONG, LONG_VAL, *); NEXT();
+    CASE(OP_DIVIDE_LL): GUARD_BINARY_OP(IS_LONG, OP_DIVIDE); SPECIALIZED_BINARY_OP(AS_LONG, LONG_VAL, /); NEXT();
+    CASE(OP_ADD_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_ADD); SPECIALIZED_BINARY_OP(AS_DOUBLE, DOUBLE_VAL, +); NEXT();
+    CASE(OP_MINUS_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_MINUS); SPECIALIZED_BINARY_OP(AS_DOUBLE, DOUBLE_VAL, -); NEXT();
+    CASE(OP_TIMES_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_TIMES); SPECIALIZED_BINARY_OP(AS_DOUBLE, DOUBLE_VAL, *); NEXT();
+    CASE(OP_DIVIDE_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_DIVIDE); SPECIALIZED_BINARY_OP(AS_DOUBLE, DOUBLE_VAL, /); NEXT();
+    CASE(OP_ADD_LONG): SPECIALIZED_BINARY_OP(AS_LONG, LONG_VAL, +); NEXT();
+    CASE(OP_MINUS_LONG): SPECIALIZED_BINARY_OP(AS_LONG, LONG_VAL, -); NEXT();
+    CASE(OP_TIMES_LONG): SPECIALIZED_BINARY_OP(AS_LONG, LONG_VAL, *); NEXT();
+    CASE(OP_DIVIDE_LONG): SPECIALIZED_BINARY_OP(AS_LONG, LONG_VAL, /); NEXT();
+    CASE(OP_ADD_DOUBLE): SPECIALIZED_BINARY_OP(AS_DOUBLE, DOUBLE_VAL, +); NEXT();
+    CASE(OP_MINUS_DOUBLE): SPECIALIZED_BINARY_OP(AS_DOUBLE, DOUBLE_VAL, -); NEXT();
+    CASE(OP_TIMES_DOUBLE): SPECIALIZED_BINARY_OP(AS_DOUBLE, DOUBLE_VAL, *); NEXT();
+    CASE(OP_DIVIDE_DOUBLE): SPECIALIZED_BINARY_OP(AS_DOUBLE, DOUBLE_VAL, /); NEXT();
+    CASE(OP_IADD): IBINARY_OP(+, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_IMINUS): IBINARY_OP(-, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_IADD_LONG): SPECIALIZED_IBINARY_OP(LONG_VAL, +, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_IMINUS_LONG): SPECIALIZED_IBINARY_OP(LONG_VAL, -, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_INC): INC_OP(e->variables[GET_ARG_A(e->codes[i])].value, GET_ARG_B(e->codes[i])); NEXT();
+    CASE(OP_INC_LOCAL): INC_OP(e->variables[base + GET_ARG_A(e->codes[i])].value, GET_ARG_B(e->codes[i])); NEXT();
+    CASE(OP_INC_LONG): SPECIALIZED_INC_OP(e->variables[GET_ARG_A(e->codes[i])].value, GET_ARG_B(e->codes[i])); NEXT();
+    CASE(OP_INC_LOCAL_LONG): SPECIALIZED_INC_OP(e->variables[base + GET_ARG_A(e->codes[i])].value, GET_ARG_B(e->codes[i])); NEXT();
+    CASE(OP_GT): QUICKEN_BINARY_OP(OP_GT_LL, OP_GT_DD); LOGICAL_BINARY_OP(>); NEXT();
+    CASE(OP_GE): QUICKEN_BINARY_OP(OP_GE_LL, OP_GE_DD); LOGICAL_BINARY_OP(>=); NEXT();
+    CASE(OP_EQEQ): QUICKEN_BINARY_OP(OP_EQEQ_LL, OP_EQEQ_DD); LOGICAL_BINARY_OP(==); NEXT();
+    CASE(OP_NEQ): QUICKEN_BINARY_OP(OP_NEQ_LL, OP_NEQ_DD); LOGICAL_BINARY_OP(!=); NEXT();
+    CASE(OP_LT): QUICKEN_BINARY_OP(OP_LT_LL, OP_LT_DD); LOGICAL_BINARY_OP(<); NEXT();
+    CASE(OP_LE): QUICKEN_BINARY_OP(OP_LE_LL, OP_LE_DD); LOGICAL_BINARY_OP(<=); NEXT();
+    CASE(OP_GT_LL): GUARD_BINARY_OP(IS_LONG, OP_GT); SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, >); NEXT();
+    CASE(OP_GE_LL): GUARD_BINARY_OP(IS_LONG, OP_GE); SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, >=); NEXT();
+    CASE(OP_EQEQ_LL): GUARD_BINARY_OP(IS_LONG, OP_EQEQ); SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, ==); NEXT();
+    CASE(OP_NEQ_LL): GUARD_BINARY_OP(IS_LONG, OP_NEQ); SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, !=); NEXT();
+    CASE(OP_LT_LL): GUARD_BINARY_OP(IS_LONG, OP_LT); SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, <); NEXT();
+    CASE(OP_LE_LL): GUARD_BINARY_OP(IS_LONG, OP_LE); SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, <=); NEXT();
+    CASE(OP_GT_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_GT); SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, >); NEXT();
+    CASE(OP_GE_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_GE); SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, >=); NEXT();
+    CASE(OP_EQEQ_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_EQEQ); SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, ==); NEXT();
+    CASE(OP_NEQ_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_NEQ); SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, !=); NEXT();
+    CASE(OP_LT_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_LT); SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, <); NEXT();
+    CASE(OP_LE_DD): GUARD_BINARY_OP(IS_DOUBLE, OP_LE); SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, <=); NEXT();
+    CASE(OP_GT_LONG): SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, >); NEXT();
+    CASE(OP_GE_LONG): SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, >=); NEXT();
+    CASE(OP_EQEQ_LONG): SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, ==); NEXT();
+    CASE(OP_NEQ_LONG): SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, !=); NEXT();
+    CASE(OP_LT_LONG): SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, <); NEXT();
+    CASE(OP_LE_LONG): SPECIALIZED_BINARY_OP(AS_LONG, BOOL_VAL, <=); NEXT();
+    CASE(OP_GT_DOUBLE): SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, >); NEXT();
+    CASE(OP_GE_DOUBLE): SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, >=); NEXT();
+    CASE(OP_EQEQ_DOUBLE): SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, ==); NEXT();
+    CASE(OP_NEQ_DOUBLE): SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, !=); NEXT();
+    CASE(OP_LT_DOUBLE): SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, <); NEXT();
+    CASE(OP_LE_DOUBLE): SPECIALIZED_BINARY_OP(AS_DOUBLE, BOOL_VAL, <=); NEXT();
+    CASE(OP_IGT): ILOGICAL_BINARY_OP(>, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_IGE): ILOGICAL_BINARY_OP(>=, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_IEQEQ): ILOGICAL_BINARY_OP(==, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_INEQ): ILOGICAL_BINARY_OP(!=, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_ILT): ILOGICAL_BINARY_OP(<, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_ILE): ILOGICAL_BINARY_OP(<=, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_IGT_LONG): SPECIALIZED_IBINARY_OP(BOOL_VAL, >, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_IGE_LONG): SPECIALIZED_IBINARY_OP(BOOL_VAL, >=, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_IEQEQ_LONG): SPECIALIZED_IBINARY_OP(BOOL_VAL, ==, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_INEQ_LONG): SPECIALIZED_IBINARY_OP(BOOL_VAL, !=, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_ILT_LONG): SPECIALIZED_IBINARY_OP(BOOL_VAL, <, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_ILE_LONG): SPECIALIZED_IBINARY_OP(BOOL_VAL, <=, GET_ARG_A(e->codes[i])); NEXT();
+    CASE(OP_LOAD_BOOL):
+      STACK_PUSH(BOOL_VAL(e->constants[GET_ARG_A(e->codes[i])].bval));
+      NEXT();
+    CASE(OP_LOAD_LONG):
+      STACK_PUSH(LONG_VAL(e->constants[GET_ARG_A(e->codes[i])].lval));
+      NEXT();
+    CASE(OP_LOAD_DOUBLE):
+      STACK_PUSH(DOUBLE_VAL(e->constants[GET_ARG_A(e->codes[i])].dval));
+      NEXT();
+    CASE(OP_LOAD_IDENT):
+      STACK_PUSH(e->variables[GET_ARG_A(e->codes[i])].value);
+      NEXT();
+    CASE(OP_LOAD_LOCAL_IDENT):
+      STACK_PUSH(e->variables[base + GET_ARG_A(e->codes[i])].value);
+      NEXT();
+    CASE(OP_LOAD_LOCAL_IDENT2):
+      STACK_PUSH(e->variables[base + GET_ARG_A(e->codes[i])].value);
+      STACK_PUSH(e->variables[base + GET_ARG_B(e->codes[i])].value);
+      NEXT();
+    CASE(OP_LOAD_FUNC):
+      STACK_PUSH(LONG_VAL(i + GET_ARG_A(e->codes[i]) + 1));
+      NEXT();
+    CASE(OP_HALT):
+      goto halt;
+    DEFAULT: printf("Unknown opcode %d\n", GET_OPCODE(e->codes[i])); exit(1);
   }
+halt:
+#ifdef COUNT
+  *instructions = count;
+#endif
+  e->stackidx = sp - e->stack;
   if (e->stackidx != 0) {
     printf("stack not consumed\n");
     exit(1);
   }
 }
+
+#undef STACK_TOP
+#undef STACK_SECOND
+#undef STACK_PUSH
+#undef STACK_DROP
+#define STACK_TOP           e->stack[e->stackidx - 1]
+#define STACK_SECOND        e->stack[e->stackidx - 2]
+#define STACK_PUSH(v)       (e->stack[e->stackidx++] = (v))
+#define STACK_DROP()        (--e->stackidx)
@@ -1,12 +1,65 @@
 #ifndef VM_H
 #define VM_H
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+
 enum value_type {
   VT_BOOL,
   VT_LONG,
   VT_DOUBLE,
 };
 
+#define VT_UNKNOWN          -1
+#define VT_UNSET            -2
+
+#ifdef NANBOX
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A value is the bit pattern of a double. Longs and bools live in the payload
+ * of negative quiet NaNs tagged 0xfffc and 0xfffd, so a long only keeps its low
+ * 48 bits: arithmetic wraps within [-2^47, 2^47 - 1]. NaNs produced by double
+ * arithmetic are canonicalized so that they never look like a tagged value.
+ */
+typedef uint64_t value;
+
+#define NANBOX_TAG_LONG     0xfffcUL
+#define NANBOX_TAG_BOOL     0xfffdUL
+#define NANBOX_PAYLOAD      0xffffffffffffUL
+
+static inline value double_value(double d) {
+  value v;
+  memcpy(&v, &d, sizeof(v));
+  if (d != d)
+    v = (v & 0x8000000000000000UL) | 0x7ff8000000000000UL;
+  return v;
+}
+
+static inline double value_double(value v) {
+  double d;
+  memcpy(&d, &v, sizeof(d));
+  return d;
+}
+
+#define VAL_TYPE(val)       ((val) >> 48 == NANBOX_TAG_LONG ? VT_LONG : \
+                             (val) >> 48 == NANBOX_TAG_BOOL ? VT_BOOL : VT_DOUBLE)
+#define IS_DOUBLE(val)      ((val) >> 48 < NANBOX_TAG_LONG)
+#define IS_LONG(val)        ((val) >> 48 == NANBOX_TAG_LONG)
+#define AS_BOOL(val)        ((bool)((val) & 1))
+#define AS_LONG(val)        ((long)((val) << 16) >> 16)
+#define AS_DOUBLE(val)      value_double(val)
+#define BOOL_VAL(b)         ((value)(NANBOX_TAG_BOOL << 48 | ((b) ? 1 : 0)))
+#define LONG_VAL(l)         ((value)(NANBOX_TAG_LONG << 48 | ((uint64_t)(l) & NANBOX_PAYLOAD)))
+#define DOUBLE_VAL(d)       double_value(d)
+
+#else
+
 typedef struct value {
   int type;
   union {
@@ -16,20 +69,32 @@ typedef struct value {
   };
 } value;
 
+#define VAL_TYPE(val)       ((val).type)
+#define IS_DOUBLE(val)      ((val).type == VT_DOUBLE)
+#define IS_LONG(val)        ((val).type == VT_LONG)
+#define AS_BOOL(val)        ((val).bval)
+#define AS_LONG(val)        ((val).lval)
+#define AS_DOUBLE(val)      ((val).dval)
+#define BOOL_VAL(b)         ((value){ .type = VT_BOOL, .bval = (b) })
+#define LONG_VAL(l)         ((value){ .type = VT_LONG, .lval = (l) })
+#define DOUBLE_VAL(d)       ((value){ .type = VT_DOUBLE, .dval = (d) })
+
+#endif
+
 #define TO_BOOL(val) (\
-  val.type == VT_DOUBLE ? val.dval != 0.0 : \
-  val.type == VT_LONG ? val.lval != 0 : \
-  val.type == VT_BOOL ? val.bval : 0)
+  VAL_TYPE(val) == VT_DOUBLE ? AS_DOUBLE(val) != 0.0 : \
+  VAL_TYPE(val) == VT_LONG ? AS_LONG(val) != 0 : \
+  VAL_TYPE(val) == VT_BOOL ? AS_BOOL(val) : 0)
 
 #define TO_LONG(val) (\
-  val.type == VT_DOUBLE ? (long)val.dval : \
-  val.type == VT_LONG ? val.lval : \
-  val.type == VT_BOOL ? (val.bval ? 1 : 0) : 0)
+  VAL_TYPE(val) == VT_DOUBLE ? (long)AS_DOUBLE(val) : \
+  VAL_TYPE(val) == VT_LONG ? AS_LONG(val) : \
+  VAL_TYPE(val) == VT_BOOL ? (AS_BOOL(val) ? 1 : 0) : 0)
 
 #define TO_DOUBLE(val) (\
-  val.type == VT_DOUBLE ? val.dval : \
-  val.type == VT_LONG ? (double)val.lval : \
-  val.type == VT_BOOL ? (val.bval ? 1.0 : 0.0) : 0.0)
+  VAL_TYPE(val) == VT_DOUBLE ? AS_DOUBLE(val) : \
+  VAL_TYPE(val) == VT_LONG ? (double)AS_LONG(val) : \
+  VAL_TYPE(val) == VT_BOOL ? (AS_BOOL(val) ? 1.0 : 0.0) : 0.0)
 
 typedef struct constant_value {
   union {
@@ -44,21 +109,62 @@ typedef struct variable {
   value value;
 } variable;
 
+typedef struct frame {
+  uint32_t pc;
+  uint32_t base;
+  uint32_t top;
+  int argc;
+} frame;
+
+#define TYPED_VARIABLES 128
+
+// The most globals, or locals of one function, that codegen gives out, so that
+// an index fits the 24-bit B operand of forprep and forloop.
+#define MAX_VARIABLES 0x800000
+
+// An open addressing table of variable indices keyed on the interned names.
+typedef struct variable_map {
+  int32_t* slots;
+  uint32_t length;
+} variable_map;
+
 typedef struct env {
-  uint16_t codesidx;
-  uint16_t codeslen;
-  uint32_t* codes;
+  uint32_t codesidx;
+  uint32_t codeslen;
+  uint64_t* codes;
   uint32_t constantsidx;
   uint32_t constantslen;
   constant_value* constants;
   uint32_t stackidx;
+  uint32_t stacklen;
   value* stack;
+  uint32_t stack_depth;
+  uint32_t frame_depth;
+  bool* entries;
   variable* variables;
   uint32_t variableslen;
+  uint32_t variablescap;
+  frame* frames;
+  uint32_t framesidx;
+  uint32_t frameslen;
+  uint32_t max_frames;
+  uint32_t max_call_stack;
   variable* local_variables;
   uint32_t local_variables_len;
-  uint16_t func_pc;
-  uint16_t while_pc;
+  uint32_t local_variables_cap;
+  variable_map variable_map;
+  variable_map local_variable_map;
+  uint32_t while_pc;
+  uint32_t for_depth;
+  int8_t* variable_types;
+  int8_t* local_variable_types;
+  int8_t** function_types;
+  uint32_t functionsidx;
+  uint32_t functionslen;
+  uint32_t typed_ops;
+  uint32_t untyped_ops;
+  char* mapping;
+  size_t mapping_size;
 } env;
 
 typedef struct func {
@@ -66,4 +172,375 @@ typedef struct func {
   void (*func)(env*, value*, int);
 } func;
 
+static inline bool evaluate_bool(env* e) {
+  value v = e->stack[--e->stackidx];
+  switch (VAL_TYPE(v)) {
+    case VT_BOOL: return AS_BOOL(v);
+    case VT_LONG: return AS_LONG(v) != 0.0;
+    case VT_DOUBLE: return AS_DOUBLE(v) != 0;
+  }
+  return true;
+}
+
+// Stdout is fully buffered whether it is a terminal or a pipe, and flushed at
+// exit or when the program reads input. Errors go through the same buffer, so
+// they stay in order with the printed values.
+static inline void init_output(void) {
+  static char buffer[1 << 16];
+  setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+}
+
+static inline void write_output(const char* s, int n) {
+  while (n-- > 0)
+    putc_unlocked(*s++, stdout);
+}
+
+// Writes the digits of x ending at end and returns the first one.
+static inline char* format_digits(char* end, unsigned long x, int width) {
+  do {
+    *--end = '0' + x % 10;
+    x /= 10;
+  } while (--width > 0 || x);
+  return end;
+}
+
+static inline void print_long(long l) {
+  char buf[24], *p = buf + sizeof(buf);
+  *--p = '\n';
+  p = format_digits(p, l < 0 ? -(unsigned long)l : (unsigned long)l, 1);
+  if (l < 0)
+    *--p = '-';
+  write_output(p, buf + sizeof(buf) - p);
+}
+
+// Prints exactly what %.9lf does. The fraction is scaled by 10^9 in 128-bit
+// integers, so the rounding (half to even) sees the exact binary value.
+static inline void print_double(double d) {
+#ifdef __SIZEOF_INT128__
+  double a = fabs(d);
+  if (a < 1e18) {
+    char buf[40], *p = buf + sizeof(buf);
+    unsigned long ip = (unsigned long)a, fp = 0;
+    double frac = a - (double)ip;
+    int exp;
+    frexp(frac, &exp);
+    if (frac != 0 && exp > -64) {
+      int k = 53 - exp;
+      unsigned __int128 m = (unsigned __int128)ldexp(frac, k) * 1000000000;
+      unsigned __int128 half = (unsigned __int128)1 << (k - 1), r = m & ((half << 1) - 1);
+      fp = (unsigned long)(m >> k);
+      if (r > half || (r == half && fp & 1))
+        fp++;
+      if (fp == 1000000000) {
+        fp = 0;
+        ip++;
+      }
+    }
+    *--p = '\n';
+    p = format_digits(p, fp, 9);
+    *--p = '.';
+    p = format_digits(p, ip, 1);
+    if (signbit(d))
+      *--p = '-';
+    write_output(p, buf + sizeof(buf) - p);
+    return;
+  }
+#endif
+  printf("%.9lf\n", d);
+}
+
+static inline void print_value(value v) {
+  switch (VAL_TYPE(v)) {
+    case VT_BOOL:
+      if (AS_BOOL(v))
+        write_output("true\n", 5);
+      else
+        write_output("false\n", 6);
+      break;
+    case VT_LONG: print_long(AS_LONG(v)); break;
+    case VT_DOUBLE: print_double(AS_DOUBLE(v)); break;
+  }
+}
+
+static inline void reserve_variables(env* e, uint32_t n) {
+  uint32_t i, len = e->variablescap;
+  uint64_t cap = len;
+  if (n <= len)
+    return;
+  while (cap < n)
+    cap *= 2;
+  if (cap > UINT32_MAX)
+    cap = UINT32_MAX;
+  e->variables = realloc(e->variables, cap * sizeof(variable));
+  if (e->variables == NULL) {
+    printf("Out of memory\n");
+    exit(1);
+  }
+  e->variablescap = cap;
+  for (i = len; i < e->variablescap; ++i) {
+    e->variables[i].name = NULL;
+    e->variables[i].value = BOOL_VAL(false);
+  }
+}
+
+// The verifier bounds the stack of the top level by stack_depth and that of
+// each call by frame_depth, so pushes need no checks. Only recursion can make
+// the stack deeper, so a call makes room for the frame before it starts.
+static inline void alloc_stack(env* e) {
+  e->stacklen = e->stack_depth + e->frame_depth + 1;
+  if (e->stacklen < 256)
+    e->stacklen = 256;
+  e->stack = calloc(e->stacklen, sizeof(value));
+}
+
+static inline void reserve_stack(env* e, uint32_t n) {
+  if (n <= e->stacklen)
+    return;
+  while (e->stacklen < n)
+    e->stacklen *= 2;
+  e->stack = realloc(e->stack, e->stacklen * sizeof(value));
+}
+
+// The bottom frame holds the top level, whose locals start after the globals.
+static inline void init_frames(env* e) {
+  e->frameslen = 64;
+  e->frames = malloc(e->frameslen * sizeof(frame));
+  e->frames[0].pc = 0;
+  e->frames[0].base = e->frames[0].top = e->variableslen;
+  e->frames[0].argc = 0;
+  e->framesidx = e->max_frames = 1;
+  e->max_call_stack = 0;
+}
+
+static inline void move_arguments(env* e, uint32_t base, int argc) {
+  int j;
+  e->stackidx -= argc;
+  for (j = 0; j < argc; ++j)
+    e->variables[base + j].value = e->stack[e->stackidx + j];
+}
+
+// Pushes a frame returning to pc right above the locals of the caller, with
+// room for the arguments. Returns the base of the frame.
+static inline uint32_t push_frame(env* e, uint32_t pc, int argc) {
+  frame* f;
+  uint32_t base = e->frames[e->framesidx - 1].top;
+  if (e->framesidx == e->frameslen) {
+    e->frameslen *= 2;
+    e->frames = realloc(e->frames, e->frameslen * sizeof(frame));
+  }
+  f = &e->frames[e->framesidx++];
+  if (e->framesidx > e->max_frames)
+    e->max_frames = e->framesidx;
+  f->pc = pc;
+  f->base = base;
+  f->top = base + argc;
+  f->argc = argc;
+  reserve_variables(e, base + argc);
+  return base;
+}
+
+// Reuses the current frame for a call in tail position.
+static inline uint32_t reuse_frame(env* e, int argc) {
+  frame* f = &e->frames[e->framesidx - 1];
+  f->argc = argc;
+  reserve_variables(e, f->base + argc);
+  return f->base;
+}
+
+static inline uint32_t call_frame(env* e, uint32_t pc, int argc) {
+  uint32_t base = push_frame(e, pc, argc);
+  move_arguments(e, base, argc);
+  if (e->stackidx > e->max_call_stack)
+    e->max_call_stack = e->stackidx;
+  reserve_stack(e, e->stackidx + e->frame_depth + 1);
+  return base;
+}
+
+// The deepest the stack can have been: the verified bound of the top level, or
+// that of a function body above the deepest stack a call left it.
+static inline uint32_t max_stack_depth(env* e) {
+  uint32_t n = e->max_call_stack + e->frame_depth;
+  return e->max_frames > 1 && n > e->stack_depth ? n : e->stack_depth;
+}
+
+static inline void tail_call_frame(env* e, int argc) {
+  move_arguments(e, reuse_frame(e, argc), argc);
+}
+
+static inline void not_a_function(void) {
+  printf("Not a function\n");
+  exit(1);
+}
+
+// The pc a call of v jumps to, which verify_codes has seen start a function.
+static inline long function_entry(env* e, value v) {
+  if (!IS_LONG(v) || AS_LONG(v) < 0 || AS_LONG(v) >= e->codesidx || !e->entries[AS_LONG(v)])
+    not_a_function();
+  return AS_LONG(v);
+}
+
+static inline void enter_frame(env* e, int locals, int params) {
+  frame* f = &e->frames[e->framesidx - 1];
+  uint32_t j;
+  if (f->argc != params) {
+    printf("Invalid number of arguments: %d (expected %d)\n", f->argc, params);
+    exit(1);
+  }
+  f->top = f->base + locals;
+  reserve_variables(e, f->top);
+  for (j = f->base + params; j < f->top; ++j)
+    e->variables[j].value = BOOL_VAL(false);
+}
+
+// A for loop goes on while its counter has not passed the limit in the
+// direction of the step.
+static inline bool for_in_range(value counter, value limit, value step) {
+  if (IS_DOUBLE(counter) || IS_DOUBLE(limit) || IS_DOUBLE(step))
+    return TO_DOUBLE(step) > 0 ? TO_DOUBLE(counter) <= TO_DOUBLE(limit) : TO_DOUBLE(counter) >= TO_DOUBLE(limit);
+  return TO_LONG(step) > 0 ? TO_LONG(counter) <= TO_LONG(limit) : TO_LONG(counter) >= TO_LONG(limit);
+}
+
+static inline bool for_prep(value counter, value limit, value step) {
+  if (IS_DOUBLE(step) ? AS_DOUBLE(step) == 0.0 : TO_LONG(step) == 0) {
+    printf("for step is zero\n");
+    exit(1);
+  }
+  return for_in_range(counter, limit, step);
+}
+
+// Steps the counter and returns whether the loop goes on. A long counter that
+// would overflow ends the loop, whatever the type of the limit.
+static inline bool for_loop(value* counter, value limit, value step) {
+  long l;
+  if (!IS_DOUBLE(*counter) && !IS_DOUBLE(step)) {
+    if (__builtin_add_overflow(TO_LONG(*counter), TO_LONG(step), &l) || AS_LONG(LONG_VAL(l)) != l)
+      return false;
+    *counter = LONG_VAL(l);
+    if (IS_DOUBLE(limit))
+      return TO_LONG(step) > 0 ? l <= AS_DOUBLE(limit) : l >= AS_DOUBLE(limit);
+    return TO_LONG(step) > 0 ? l <= TO_LONG(limit) : l >= TO_LONG(limit);
+  }
+  *counter = DOUBLE_VAL(TO_DOUBLE(*counter) + TO_DOUBLE(step));
+  return for_in_range(*counter, limit, step);
+}
+
+// The operation macros reach the stack only through these four, so that an
+// interpreter can keep the stack pointer and the top value in locals.
+#ifndef STACK_TOP
+#define STACK_TOP           e->stack[e->stackidx - 1]
+#define STACK_SECOND        e->stack[e->stackidx - 2]
+#define STACK_PUSH(v)       (e->stack[e->stackidx++] = (v))
+#define STACK_DROP()        (--e->stackidx)
+#endif
+
+#define UNARY_OP(op) \
+  do { \
+    value val = STACK_TOP; \
+    if (IS_DOUBLE(val)) { \
+      STACK_TOP = DOUBLE_VAL(op(AS_DOUBLE(val))); \
+      \
+    } else { \
+      STACK_TOP = LONG_VAL(op(TO_LONG(val))); \
+    } \
+  } while(0);
+
+#define BINARY_OP(op) \
+  do { \
+    value rhs = STACK_TOP; \
+    value lhs = (STACK_DROP(), STACK_TOP); \
+    if (IS_DOUBLE(lhs) || IS_DOUBLE(rhs)) { \
+      STACK_TOP = DOUBLE_VAL(TO_DOUBLE(lhs) op TO_DOUBLE(rhs)); \
+      \
+    } else { \
+      STACK_TOP = LONG_VAL(TO_LONG(lhs) op TO_LONG(rhs)); \
+    } \
+  } while(0);
+
+#define IBINARY_OP(op, a) \
+  do { \
+    value v = STACK_TOP; \
+    if (IS_DOUBLE(v)) { \
+      STACK_TOP = DOUBLE_VAL(AS_DOUBLE(v) op (a)); \
+      \
+    } else { \
+      STACK_TOP = LONG_VAL(TO_LONG(v) op (a)); \
+    } \
+  } while(0);
+
+#define INC_OP(var, b) \
+  do { \
+    value v = var; \
+    if (IS_DOUBLE(v)) { \
+      var = DOUBLE_VAL(AS_DOUBLE(v) + (b)); \
+      \
+    } else { \
+      var = LONG_VAL(TO_LONG(v) + (b)); \
+    } \
+  } while(0);
+
+#define ILOGICAL_BINARY_OP(op, a) \
+  do { \
+    value v = STACK_TOP; \
+    if (IS_DOUBLE(v)) { \
+      STACK_TOP = BOOL_VAL(AS_DOUBLE(v) op (a)); \
+      \
+    } else { \
+      STACK_TOP = BOOL_VAL(TO_LONG(v) op (a)); \
+    } \
+  } while(0);
+
+#define JMP_IFNOT_BINARY_OP(op, jump) \
+  do { \
+    value rhs = STACK_TOP; \
+    value lhs = STACK_SECOND; \
+    STACK_DROP(); \
+    STACK_DROP(); \
+    if (IS_DOUBLE(lhs) || IS_DOUBLE(rhs)) { \
+      if (!(TO_DOUBLE(lhs) op TO_DOUBLE(rhs))) \
+        jump; \
+    } else { \
+      if (!(TO_LONG(lhs) op TO_LONG(rhs))) \
+        jump; \
+    } \
+  } while(0);
+
+#define LOGICAL_BINARY_OP(op) \
+  do { \
+    value rhs = STACK_TOP; \
+    value lhs = (STACK_DROP(), STACK_TOP); \
+    if (IS_DOUBLE(lhs) || IS_DOUBLE(rhs)) { \
+      STACK_TOP = BOOL_VAL(TO_DOUBLE(lhs) op TO_DOUBLE(rhs)); \
+      \
+    } else { \
+      STACK_TOP = BOOL_VAL(TO_LONG(lhs) op TO_LONG(rhs)); \
+    } \
+  } while(0);
+
+#define SPECIALIZED_BINARY_OP(as_type, type_val, op) \
+  do { \
+    value rhs = STACK_TOP; \
+    STACK_DROP(); \
+    STACK_TOP = type_val(as_type(STACK_TOP) op as_type(rhs)); \
+  } while(0);
+
+#define SPECIALIZED_IBINARY_OP(type_val, op, a) \
+  do { \
+    STACK_TOP = type_val(AS_LONG(STACK_TOP) op (a)); \
+  } while(0);
+
+#define SPECIALIZED_INC_OP(var, b) \
+  do { \
+    var = LONG_VAL(AS_LONG(var) + (b)); \
+  } while(0);
+
+#define SPECIALIZED_JMP_IFNOT_BINARY_OP(as_type, op, jump) \
+  do { \
+    value rhs = STACK_TOP; \
+    value lhs = STACK_SECOND; \
+    STACK_DROP(); \
+    STACK_DROP(); \
+    if (!(as_type(lhs) op as_type(rhs))) \
+      jump; \
+  } while(0);
+
 #endif